@@ -86,7 +86,8 @@ struct actor {
     unsigned int unique : 1;
     unsigned int can_tech : 1; /* Can tech a wallslam */
     unsigned int saved : 1; /* Infinite file write loop prevention. */
-    /* 5 free bits */
+    unsigned int pooled : 1; /* Allocated from the actor pool. */
+    /* 4 free bits */
 };
 
 #define is_noatk(x) \
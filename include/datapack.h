@@ -0,0 +1,34 @@
+#ifndef DATAPACK_H
+#define DATAPACK_H
+
+struct wfc_image;
+struct wfc_rules;
+
+/* Where the compiled data pack and data image are installed, relative to
+   the game. */
+#define DATA_PACK "data/zenzi.pack"
+#define DATA_IMAGE "data/zenzi.image"
+
+/* What a data file holds, and so where it is loaded to. */
+#define DATA_MONSTERS 0
+#define DATA_ITEMS    1
+#define DATA_WFC      2
+
+struct data_file {
+    const char *fname;
+    int kind;
+};
+
+extern const struct data_file data_files[];
+extern const int num_data_files;
+
+/* Function Prototypes */
+void load_game_data(void);
+int load_data_image(const char *);
+int load_data_pack(const char *);
+int compile_data_pack(const char *);
+int compile_data_image(const char *, const char *);
+struct wfc_image load_wfc_image(const char *);
+const struct wfc_rules *load_wfc_rules(const char *);
+
+#endif
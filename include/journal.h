@@ -0,0 +1,22 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+struct action;
+
+/* Function Prototypes */
+void journal_open(int);
+void journal_replay_file(const char *);
+void journal_report(void);
+void journal_set_keep(int);
+void journal_close(void);
+void journal_delete(void);
+void journal_begin(struct action *);
+void journal_end(struct action *);
+void journal_flush(void);
+unsigned long journal_seq(void);
+void journal_set_seq(unsigned long);
+void journal_compact(unsigned long);
+int journal_replaying(void);
+int journal_replay_only(void);
+
+#endif
@@ -48,8 +48,6 @@ extern struct hm_def heatmaps[NUM_HEATMAPS];
     (g.levmap[x][y].explored)
 #define is_lit(x, y) \
     (g.levmap[x][y].lit)
-#define needs_refresh(x, y) \
-    (g.levmap[x][y].refresh)
 
 /* lookup */
 #define MON_AT(x, y) \
@@ -1,8 +1,54 @@
 #ifndef MAPGEN_H
 #define MAPGEN_H
 
+struct wfc_image;
+struct wfc_rules;
+
+/* How levels are generated: by wave function collapse from the wfc data
+   file chosen with set_wfc_rules, as caves grown by a cellular automaton, or
+   a mix of the two, with each level's kind drawn from its seed. Saves and
+   journals record which, since it changes the levels a seed makes. */
+#define MAPGEN_WFC   0
+#define MAPGEN_CAVES 1
+#define MAPGEN_MIXED 2
+
+/* What wfc_generate and wfc_mapgen return. */
+#define WFC_SUCCESS 0
+#define WFC_ERROR 1
+
+/* Limits a cell of the map to some of the pixels of the wfc input image
+   before generation starts, so that what has to be there is built in rather
+   than patched on afterwards. A set piece is a mask with a single pixel for
+   each of its cells. */
+struct wfc_mask {
+    int x;
+    int y;
+    const char *pixels; /* The pixels the cell may take. */
+    int count;          /* How many there are. */
+};
+
+/* What generating the last level took, for measuring the generator. Only
+   the wfc runs whose outcome was used are counted, not those cancelled
+   because an earlier attempt had already succeeded. */
+struct mapgen_stats {
+    int attempts;       /* wfc runs, counting each chunk's separately */
+    int contradictions; /* Runs that failed even after backtracking */
+    long backtracks;    /* Choices undone, over every run */
+    int chunked;        /* Whether the level was solved a chunk at a time */
+    int fallback;       /* Whether wfc failed and the level is open floor */
+};
+
+extern struct mapgen_stats mapgen_stats;
+
 /* Function Prototypes */
 void make_level(void);
+void set_mapgen(int);
+int get_mapgen(void);
+void set_wfc_rules(const char *);
+int wfc_generate(int, int, int, int, const struct wfc_mask *, int, unsigned char *);
+int wfc_mapgen(int, int, int, int, const struct wfc_mask *, int);
+int add_set_piece(struct wfc_mask *, int, int, const char *const *);
+struct wfc_rules *compile_wfc_rules(struct wfc_image *);
 void set_spawn_countdown(void);
 
 #endif
\ No newline at end of file
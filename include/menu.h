@@ -17,11 +17,16 @@ struct menu {
     int selected;
 };
 
+/* Menus are provided by the active windowport. */
+#define menu_new (*windowprocs.win_menu_new)
+#define menu_add_item (*windowprocs.win_menu_add_item)
+#define menu_do_choice (*windowprocs.win_menu_do_choice)
+#define menu_destroy (*windowprocs.win_menu_destroy)
+
 /* Function Prototypes */
-struct menu *menu_new(const char *, int, int, int, int);
-void menu_add_item(struct menu *, unsigned char, const char *);
-void display_menu(struct menu *);
-signed char menu_do_choice(struct menu *, int);
-void menu_destroy(struct menu *);
+struct menu *curses_menu_new(const char *, int, int, int, int);
+void curses_menu_add_item(struct menu *, unsigned char, const char *);
+signed char curses_menu_do_choice(struct menu *, int);
+void curses_menu_destroy(struct menu *);
 
 #endif
\ No newline at end of file
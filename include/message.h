@@ -3,6 +3,7 @@
 
 struct msg {
     char *msg;
+    unsigned long id; /* Increases with every message logged. */
     int turn;
     int attr;
     struct msg *next;
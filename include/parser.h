@@ -4,10 +4,15 @@
 /* Include so that we can parse wfc from json. */
 #include "wfc.h"
 
+/* Attributes that a data file can ask to have shuffled between games. */
+#define SHUFFLE_APPEARANCE 0x01
+#define SHUFFLE_COLOR      0x02
+
 /* Function Prototypes */
-struct wfc_image parse_wfc_json(char *infile);
+struct wfc_image parse_wfc_json(const char *infile);
 struct actor *actor_from_file(const char *);
-void json_to_actor_array(const char *, int *, struct actor **);
+int parse_actor_file(const char *, int *, struct actor **);
+void shuffle_attributes(struct actor **, int, int, int, int);
 void json_to_item_list(const char *);
 
 #endif
\ No newline at end of file
@@ -1,12 +1,41 @@
 #ifndef RANDOM_H
 #define RANDOM_H
 
+#include <stdint.h>
+
+#define RND_MAX 0x7fffffff
+
+/* Independent random number streams. Each subsystem draws from its own, so
+   that, for instance, generating a level never changes the outcome of a
+   fight. */
+enum rng_stream {
+    RNG_MAPGEN,
+    RNG_COMBAT,
+    RNG_AI,
+    RNG_SPAWN,
+    RNG_MAX
+};
+
+/* A generator of its own, outside the streams, for work that runs off the
+   main thread. */
+struct rng {
+    uint64_t s[4];
+};
+
 /* Function Prototypes */
-void rndseed(int);
+void rndseed(uint64_t);
 void rndseed_t(void);
-int rndmx(int);
-int rndrng(int, int);
-int rndbool(void);
-int d(int, int);
+void rnd_stream_seed(int, uint64_t);
+int rnd_raw(int);
+void rnd_fork(int, struct rng *, int);
+int rnd_raw_from(struct rng *);
+uint64_t rnd_seed(void);
+unsigned long rnd_draws(void);
+void rnd_get_state(uint64_t [RNG_MAX][4]);
+void rnd_set_state(uint64_t, unsigned long, uint64_t [RNG_MAX][4]);
+int rndmx(int, int);
+int rndrng(int, int, int);
+int rndbool(int);
+int d(int, int, int);
 
 #endif
\ No newline at end of file
@@ -69,7 +69,9 @@ typedef struct bitflags {
     unsigned int mode_map : 1;
     unsigned int mode_look : 1;
     unsigned int mode_mapgen : 1;
-    /* 0 free bit */
+    /* Set when a save has been loaded partway through the player's turn */
+    unsigned int resume_turn : 1;
+    /* 7 free bits */
 } bitflags;
 
 typedef struct terminal {
@@ -87,6 +89,7 @@ typedef struct terminal {
     int sb_h;
     char *saved_locale;
     char hudmode;
+    int max_fps; /* Frame cap while running or exploring. 0 skips to the last frame. */
 } terminal;
 
 extern struct global g;
@@ -5,11 +5,10 @@
 void render_all(void);
 void refresh_cell(int, int);
 void mark_refresh(int, int);
+void mark_refresh_rect(int, int, int, int);
 void render_map(void);
 void render_all_actors(void);
 void clear_actors(void);
 int switch_viewmode(void);
 
-#define mark_refresh(x, y) (g.levmap[x][y].refresh = 1)
-
 #endif
\ No newline at end of file
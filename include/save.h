@@ -1,10 +1,61 @@
 #ifndef SAVE_H
 #define SAVE_H
 
+#include <stddef.h>
+
+struct actor;
+
+/* The version of the save format, which also covers the actor records that
+   the data pack is built from. */
+#define SAVE_VERSION 4
+
+/* Kinds of allocation carved out of the actor pool. */
+#define POOL_ACTOR  0
+#define POOL_NAME   1
+#define POOL_AI     2
+#define POOL_ITEM   3
+#define POOL_EQUIP  4
+#define POOL_MAX    5
+
+/* A growable byte buffer that the game is serialized into, or read back
+   from. */
+struct save_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    size_t pos;   /* Read position. */
+    int error;    /* Set if a read ran past the end of the buffer. */
+};
+
 /* Function Prototypes */
+void put_bytes(struct save_buf *, const void *, size_t);
+void put_byte(struct save_buf *, unsigned char);
+void put_uvar(struct save_buf *, unsigned long);
+void put_svar(struct save_buf *, long);
+void put_str(struct save_buf *, const char *);
+unsigned char get_byte(struct save_buf *);
+unsigned long get_uvar(struct save_buf *);
+long get_svar(struct save_buf *);
+void get_str(struct save_buf *, char *, size_t);
+int write_save_file(const char *, const struct save_buf *);
 int file_exists(const char *);
 int save_exit(void);
 void save_game(void);
-void load_game(const char *);
+void save_game_async(void);
+void finish_saving(void);
+void set_autosave_interval(int);
+void autosave(void);
+void delete_save(void);
+int load_game(const char *);
+void encode_game(struct save_buf *);
+int decode_game(struct save_buf *);
+void encode_actor(struct save_buf *, struct actor *);
+struct actor *decode_actor(struct save_buf *);
+void count_actor(struct actor *, unsigned long *);
+void reset_saved_actor(struct actor *);
+size_t pool_size(const unsigned long *, size_t *);
+void pool_reserve(const unsigned long *);
+void pool_place(void *, const unsigned long *);
+void free_actor_pool(void);
 
 #endif
\ No newline at end of file
@@ -33,8 +33,7 @@ struct tile {
     unsigned int visible : 1;
     unsigned int lit : 1;
     unsigned int explored : 1;
-    unsigned int refresh : 1;
-    /* 4 free bits */
+    /* 5 free bits */
 };
 
 /* Function Prototypes */
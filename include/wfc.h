@@ -56,7 +56,9 @@
 // The output image will have the same number of components as the input
 // image.
 //
-// wfc_run returns 0 if it cannot find a solution. You can try again like so:
+// wfc_run undoes its last choices when they lead to a contradiction, up to
+// WFC_MAX_BACKTRACK_CNT times, and returns 0 if it still cannot find a
+// solution. You can try again like so:
 //
 //         wfc_init(wfc);
 //         wfc_run(wfc, -1);
@@ -130,7 +132,11 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct wfc;
+struct wfc_rules;
 
 struct wfc_image {
   unsigned char *data;
@@ -149,8 +155,36 @@ struct wfc *wfc_overlapping(int output_width,              // Output width in pi
                             int yflip_tiles,               // Add yflips of all tiles
                             int rotate_tiles);             // Add n*90deg rotations of all tiles
 
+// Rules can be compiled once and shared by any number of wfc instances.
+// wfc_overlapping compiles its own rules and destroys them with the wfc.
+struct wfc_rules *wfc_overlapping_rules(struct wfc_image *image,    // Input image to be cut into tiles
+                                        int tile_width,             // Tile width in pixels
+                                        int tile_height,            // Tile height in pixels
+                                        int expand_input,           // Wrap input image on right and bottom
+                                        int xflip_tiles,            // Add xflips of all tiles
+                                        int yflip_tiles,            // Add yflips of all tiles
+                                        int rotate_tiles);          // Add n*90deg rotations of all tiles
+struct wfc *wfc_from_rules(int output_width,               // Output width in pixels
+                           int output_height,              // Output height in pixels
+                           const struct wfc_rules *rules,  // Not copied, must outlive the wfc
+                           void *rand_state);              // Passed to WFC_RAND
+size_t wfc_rules_size(const struct wfc_rules *rules);      // Bytes needed by wfc_rules_copy
+struct wfc_rules *wfc_rules_copy(const struct wfc_rules *rules, void *dst); // Copy into one block
+void wfc_rules_destroy(struct wfc_rules *rules);           // Not for copies
+int wfc_rules_words(const struct wfc_rules *rules);        // Words in a bitset of tiles
+int wfc_rules_pixel_tiles(const struct wfc_rules *rules,   // Sets the bits of the tiles
+                          const unsigned char *pixels,     // that output one of pixel_cnt
+                          int pixel_cnt,                   // pixels, and returns how
+                          uint64_t *tiles);                // many there are
+
 void wfc_init(struct wfc *wfc); // Resets wfc generation, wfc_run can be called again
+void wfc_set_rand_state(struct wfc *wfc, void *rand_state); // Takes effect from wfc_init
+void wfc_set_cancel(struct wfc *wfc, const int *cancel); // wfc_run fails once *cancel is set
+int wfc_fix_tile(struct wfc *wfc, int x, int y, int tile_idx); // After wfc_init, before wfc_run
+int wfc_restrict_tiles(struct wfc *wfc, int x, int y, const uint64_t *tiles); // Likewise
+int wfc_tile_at(struct wfc *wfc, int x, int y);           // -1 unless one tile is left
 int wfc_run(struct wfc *wfc, int max_collapse_cnt);
+int wfc_backtrack_cnt(struct wfc *wfc); // Choices undone by the last wfc_run
 int wfc_export(struct wfc *wfc, const char *filename);
 void wfc_destroy(struct wfc *wfc);
 
@@ -178,8 +212,21 @@ void wfc_destroy(struct wfc *wfc);
 #include <ctype.h>
 #include <time.h>
 #include <assert.h>
+#include <stdint.h>
+
+/* The game supplies its own generator so that it can keep track of every
+   number drawn. It is handed the wfc's rand_state, so that wfcs running on
+   different threads can draw from generators of their own. */
+#ifndef WFC_RAND
+#define WFC_RAND(rand_state) rand()
+#define WFC_RAND_MAX RAND_MAX
+#endif
 
-#define WFC_MAX_PROP_CNT 1000
+/* How many choices wfc_run may undo after contradictions before it gives
+   up. */
+#ifndef WFC_MAX_BACKTRACK_CNT
+#define WFC_MAX_BACKTRACK_CNT 1000
+#endif
 
 #ifndef WFC_USE_STB
 
@@ -225,9 +272,15 @@ struct wfc__tile {
                                // selected when collapsing a cell.
 };
 
+// Sets of tiles are bitsets, with bit i of word i/64 standing for tile i.
+// A cell's possible tiles and each row of the rules are such sets, so that
+// propagating is done a word, rather than a tile, at a time.
+#define WFC__WORDS(bit_cnt) (((bit_cnt) + 63) / 64)
+
 struct wfc__cell {
-  int *tiles;                  // Possible tiles in the cell (initially all)
-  int tile_cnt;
+  uint64_t *tiles;             // Bitset of possible tiles in the cell
+                               // (initially all)
+  int tile_cnt;                // Number of bits set in tiles
 
   int sum_freqs;               // Sum of tile frequencies used to calculate
                                // entropy and randomly pick a tile when
@@ -235,18 +288,47 @@ struct wfc__cell {
 
   double entropy;              // Shannon entropy. Cell with the smallest entropy
                                // is picked to be collapsed next.
+
+  double noise;                // Small random amount added to the entropy
+                               // to break ties between cells
+};
+
+// Everything wfc_run needs to know about the tiles. Never written once
+// compiled, so it can live in read-only or shared memory.
+struct wfc_rules {
+  int tile_width;              // Tile width in pixels
+  int tile_height;             // Tile height in pixels
+  int component_cnt;           // Components per pixel of the input image
+  struct wfc__tile *tiles;     // All available tiles
+  int tile_cnt;
+  int words;                   // Words in a bitset of tiles
+
+  // These are the rules. A bitset of allowed tiles for each tile in each
+  // direction. Bit dst_idx of the bitset at allowed_tiles[d] +
+  // src_idx*words is set if dst_idx tile can be placed next to the
+  // src_idx tile in the direction d.
+  //
+  // In the overlapping method tiles are allowed next to each other if
+  // their content overlaps, excluding the edges.
+  uint64_t *allowed_tiles[4];
 };
 
-struct wfc__prop {
-  int src_cell_idx;
-  int dst_cell_idx;
-  enum wfc__direction direction;
+// A tile chosen for a cell by wfc__collapse, which can be undone by
+// wfc__backtrack
+struct wfc__choice {
+  int cell_idx;
+  int tile_idx;
+  int trail_cnt;               // Length of the trail before the choice
+  int sum_freqs;               // The cell's sum_freqs and entropy before the
+  double entropy;              // choice, which the collapse zeroes
 };
 
 // One structure for overlapping and tiled models
 struct wfc {
   enum wfc__method method;     // overlapping or tiled?
   unsigned int seed;
+  void *rand_state;            // Passed to WFC_RAND
+  const int *cancel;           // Gives up the run when set, or NULL
 
   /* tiles */
 
@@ -257,8 +339,11 @@ struct wfc {
   int xflip_tiles;
   int yflip_tiles;
   int rotate_tiles;
-  struct wfc__tile *tiles;     // All available tiles
+  const struct wfc_rules *rules;
+  struct wfc_rules *own_rules; // Rules to destroy along with the wfc
+  struct wfc__tile *tiles;     // rules->tiles
   int tile_cnt;
+  int words;                   // rules->words
   int sum_freqs;
 
   /* output */
@@ -270,39 +355,42 @@ struct wfc {
 
   /* in-use */
 
-  struct wfc__prop *props;     // Propagation updates
-  int prop_cnt;
-  int prop_idx;                // Current index into props, used to scan
-                               // props forward to check whether a
-                               // a candidate prop is already there
+  // supports[(cell_idx*tile_cnt + tile_idx)*4 + d] counts the tiles still
+  // possible in the neighbouring cell that the direction d leads from
+  // which allow tile_idx in the cell. When it drops to 0 the tile is
+  // removed from the cell.
+  int *supports;
+  int *tile_supports;          // Initial supports of each tile, tile_cnt*4
+
+  int *trail;                  // Every tile removed since wfc_init, in
+                               // order, as cell_idx*tile_cnt + tile_idx.
+                               // A tile is removed from a cell only once,
+                               // so there are never more than cell_cnt *
+                               // tile_cnt of them.
+  int trail_cnt;
+  int propagated_cnt;          // Removals at the start of the trail that
+                               // have been propagated. The rest are queued.
+  int contradiction;           // A cell was left without tiles
   int collapsed_cell_cnt;
 
-  // These are the rules. A matrix lookup of allowed tile pairs in each
-  // direction. allowed_tiles[d][src_idx*tile_cnt + dst_idx] is 1 or 0
-  // depending on whether dst_idx tile can be placed next to the src_idx
-  // tile in the direction d.
-  //
-  // In the overlapping method tiles are allowed next to each other if
-  // their content overlaps, excluding the edges.
-  int *allowed_tiles[4];
+  // Choices that can still be undone, oldest first. Each one collapsed a
+  // different cell, so there are never more than cell_cnt of them.
+  struct wfc__choice *choices;
+  int choice_cnt;
+  int backtrack_cnt;           // Choices undone by this run so far
+
+  // Min-heap of cells by entropy plus noise, to find the next cell to
+  // collapse. Entropy falls as tiles are removed, moving a cell up, and
+  // only rises again when a backtrack puts tiles back. Cells that have
+  // collapsed are dropped when they reach the top, and pushed again if a
+  // backtrack reopens them.
+  int *heap;                   // Cell indices
+  int *heap_pos;               // Position of each cell in heap, or -1
+  int heap_cnt;
+
+  uint64_t *allowed_tiles[4];  // rules->allowed_tiles
 };
 
-#ifdef WFC_DEBUG
-static const char *wfc__direction_strings[4] = {"up","down","left","right"};
-
-static void wfc__print_prop(struct wfc__prop *p, const char *prefix)
-{
-  printf("%s%d -> %s -> %d\n", prefix, p->src_cell_idx, direction_strings[p->direction], p->dst_cell_idx);
-}
-
-static void wfc__print_props(struct wfc__prop *p, int prop_cnt, const char *prefix)
-{
-  for (int i=0; i<prop_cnt; i++) {
-    print_prop(&(p[i]), prefix);
-  }
-}
-#endif // WFC_DEBUG
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Img helpers
@@ -597,6 +685,17 @@ static void wfc_destroy_cells(int *cells)
   free(cells);
 }
 
+// Index of the lowest tile still possible in the cell, or -1 if none is
+static int wfc__first_tile(struct wfc *wfc, int cell_idx)
+{
+  uint64_t *tiles = wfc->cells[cell_idx].tiles;
+  for (int w=0; w<wfc->words; w++) {
+    if (tiles[w])
+      return w*64 + __builtin_ctzll(tiles[w]);
+  }
+  return -1;
+}
+
 // Return NULL on error
 static int *wfc_cells(struct wfc *wfc)
 {
@@ -605,14 +704,14 @@ static int *wfc_cells(struct wfc *wfc)
     return NULL;
 
   for (int i=0; i<wfc->cell_cnt; i++)
-    cells[i] = wfc->cells[i].tiles[0];
+    cells[i] = wfc__first_tile(wfc, i);
 
   return cells;
 }
 
 struct wfc_image *wfc_output_image(struct wfc *wfc)
 {
-  struct wfc_image *image = wfc_img_create(wfc->output_width, wfc->output_height, wfc->image->component_cnt);
+  struct wfc_image *image = wfc_img_create(wfc->output_width, wfc->output_height, wfc->rules->component_cnt);
   if (image == NULL) {
     p("wfc_export: error\n");
     return 0;
@@ -623,15 +722,17 @@ struct wfc_image *wfc_output_image(struct wfc *wfc)
       struct wfc__cell *cell = &( wfc->cells[y * wfc->output_width + x] );
 
       double components[4] = {0, 0, 0, 0};
-      for (int i=0; i<cell->tile_cnt; i++) {
-        struct wfc__tile *tile = &( wfc->tiles[ cell->tiles[i] ] );
-        for (int j=0; j<wfc->image->component_cnt; j++) {
-          components[j] += tile->image->data[j];
+      for (int w=0; w<wfc->words; w++) {
+        for (uint64_t bits=cell->tiles[w]; bits; bits &= bits - 1) {
+          struct wfc__tile *tile = &( wfc->tiles[ w*64 + __builtin_ctzll(bits) ] );
+          for (int j=0; j<wfc->rules->component_cnt; j++) {
+            components[j] += tile->image->data[j];
+          }
         }
       }
 
-      for (int i=0; i<wfc->image->component_cnt; i++) {
-        image->data[y * wfc->output_width * wfc->image->component_cnt + x * wfc->image->component_cnt + i] = (unsigned char)(components[i] / cell->tile_cnt);
+      for (int i=0; i<wfc->rules->component_cnt; i++) {
+        image->data[y * wfc->output_width * wfc->rules->component_cnt + x * wfc->rules->component_cnt + i] = (unsigned char)(components[i] / cell->tile_cnt);
       }
     }
   }
@@ -813,19 +914,11 @@ static int wfc__remove_duplicate_tiles(struct wfc__tile **tiles, int *tile_cnt)
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-static void wfc__destroy_props(struct wfc__prop *props)
-{
-  free(props);
-}
-
-static struct wfc__prop *wfc__create_props(int cell_cnt)
-{
-  struct wfc__prop *props = malloc(sizeof(*props) * cell_cnt * WFC_MAX_PROP_CNT);
-  return props;
-}
-
 static void wfc__destroy_cells(struct wfc__cell *cells, int cell_cnt)
 {
+  if (cells == NULL)
+    return;
+
   free(cells[0].tiles);
   free(cells);
 }
@@ -833,19 +926,16 @@ static void wfc__destroy_cells(struct wfc__cell *cells, int cell_cnt)
 // Return NULL on error
 static struct wfc__cell *wfc__create_cells(int cell_cnt, int tile_cnt)
 {
+  int words = WFC__WORDS(tile_cnt);
   struct wfc__cell *cells = malloc(sizeof(*cells) * cell_cnt);
   if (cells == NULL)
     goto CLEANUP;
 
-  for (int i=0; i<cell_cnt; i++)
-    cells[i].tiles = NULL;
-
-  cells[0].tiles = malloc(sizeof(*(cells[0].tiles)) * tile_cnt * cell_cnt);
-  for (int i=1; i<cell_cnt; i++) {
-    cells[i].tiles = cells[0].tiles + i * tile_cnt;
-    if (cells[i].tiles == NULL)
-      goto CLEANUP;
-  }
+  cells[0].tiles = malloc(sizeof(*(cells[0].tiles)) * words * cell_cnt);
+  if (cells[0].tiles == NULL)
+    goto CLEANUP;
+  for (int i=1; i<cell_cnt; i++)
+    cells[i].tiles = cells[0].tiles + i * words;
 
   return cells;
 
@@ -889,17 +979,20 @@ static struct wfc__tile *wfc__create_tiles(int tile_cnt)
   return NULL;
 }
 
-static void wfc__destroy_allowed_tiles(int *allowed_tiles[4])
+static void wfc__destroy_allowed_tiles(uint64_t *allowed_tiles[4])
 {
   free(allowed_tiles[0]);
 }
 
 // Return 0 on error
-static int wfc__create_allowed_tiles(int *allowed_tiles[4], int tile_cnt)
+static int wfc__create_allowed_tiles(uint64_t *allowed_tiles[4], int tile_cnt)
 {
-  allowed_tiles[0] = malloc(sizeof(*allowed_tiles[0]) * tile_cnt * tile_cnt * 4);
+  size_t row_cnt = (size_t)tile_cnt * WFC__WORDS(tile_cnt);
+  allowed_tiles[0] = calloc(row_cnt * 4, sizeof(*allowed_tiles[0]));
+  if (allowed_tiles[0] == NULL)
+    goto CLEANUP;
   for (int i=1; i<4; i++)
-    allowed_tiles[i] = allowed_tiles[0] + i * tile_cnt * tile_cnt;
+    allowed_tiles[i] = allowed_tiles[0] + i * row_cnt;
 
   return 1;
 
@@ -910,180 +1003,310 @@ static int wfc__create_allowed_tiles(int *allowed_tiles[4], int tile_cnt)
   return 0;
 }
 
-static void wfc__add_prop(struct wfc *wfc, int src_cell_idx, int dst_cell_idx, enum wfc__direction direction)
+// Index of the cell next to cell_idx in the direction, or -1 if there is
+// none
+static int wfc__neighbour(struct wfc *wfc, int cell_idx, enum wfc__direction d)
 {
-  // TODO: check for wfc->prop_cnt == WFC_MAX_PROP_CNT
-
-  struct wfc__prop *p = &( wfc->props[wfc->prop_cnt] );
-  (wfc->prop_cnt)++;
-  p->src_cell_idx = src_cell_idx;
-  p->dst_cell_idx = dst_cell_idx;
-  p->direction = direction;
+  switch (d) {
+  case WFC_UP:
+    return cell_idx - wfc->output_width >= 0 ? cell_idx - wfc->output_width : -1;
+  case WFC_DOWN:
+    return cell_idx + wfc->output_width < wfc->cell_cnt ? cell_idx + wfc->output_width : -1;
+  case WFC_LEFT:
+    return cell_idx % wfc->output_width != 0 ? cell_idx - 1 : -1;
+  case WFC_RIGHT:
+    return cell_idx % wfc->output_width != wfc->output_width - 1 ? cell_idx + 1 : -1;
+  }
+  return -1;
 }
 
-// add prop to update cell above the cell_idx
-static void wfc__add_prop_up(struct wfc *wfc, int src_cell_idx)
+// The direction that leads back the way d came
+static enum wfc__direction wfc__opposite(enum wfc__direction d)
 {
-  if (src_cell_idx - wfc->output_width >= 0) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx - wfc->output_width, WFC_UP);
+  switch (d) {
+  case WFC_UP:    return WFC_DOWN;
+  case WFC_DOWN:  return WFC_UP;
+  case WFC_LEFT:  return WFC_RIGHT;
+  case WFC_RIGHT: return WFC_LEFT;
   }
+  return d;
 }
 
-static void wfc__add_prop_down(struct wfc *wfc, int src_cell_idx)
+static int wfc__has_tile(struct wfc *wfc, int cell_idx, int tile_idx)
 {
-  if (src_cell_idx + wfc->output_width < wfc->cell_cnt) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx + wfc->output_width, WFC_DOWN);
-  }
+  return (wfc->cells[cell_idx].tiles[tile_idx / 64] >> (tile_idx % 64)) & 1;
+}
+
+static int wfc__heap_less(struct wfc *wfc, int a, int b)
+{
+  double ea = wfc->cells[a].entropy + wfc->cells[a].noise;
+  double eb = wfc->cells[b].entropy + wfc->cells[b].noise;
+  return ea < eb || (ea == eb && a < b);
 }
 
-static void wfc__add_prop_left(struct wfc *wfc, int src_cell_idx)
+static void wfc__heap_swap(struct wfc *wfc, int i, int j)
 {
-  if (src_cell_idx % wfc->output_width != 0) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx - 1, WFC_LEFT);
+  int tmp = wfc->heap[i];
+  wfc->heap[i] = wfc->heap[j];
+  wfc->heap[j] = tmp;
+  wfc->heap_pos[wfc->heap[i]] = i;
+  wfc->heap_pos[wfc->heap[j]] = j;
+}
+
+// Moves a cell whose entropy fell up the heap
+static void wfc__heap_up(struct wfc *wfc, int cell_idx)
+{
+  int i = wfc->heap_pos[cell_idx];
+  if (i < 0)
+    return;
+
+  while (i > 0 && wfc__heap_less(wfc, wfc->heap[i], wfc->heap[(i-1)/2])) {
+    wfc__heap_swap(wfc, i, (i-1)/2);
+    i = (i-1)/2;
   }
 }
 
-static void wfc__add_prop_right(struct wfc *wfc, int src_cell_idx)
+static void wfc__heap_down(struct wfc *wfc, int i)
 {
-  if (src_cell_idx % wfc->output_width != wfc->output_width - 1) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx + 1, WFC_RIGHT);
+  while (1) {
+    int min = i;
+    int l = 2*i + 1;
+    int r = 2*i + 2;
+    if (l < wfc->heap_cnt && wfc__heap_less(wfc, wfc->heap[l], wfc->heap[min]))
+      min = l;
+    if (r < wfc->heap_cnt && wfc__heap_less(wfc, wfc->heap[r], wfc->heap[min]))
+      min = r;
+    if (min == i)
+      return;
+    wfc__heap_swap(wfc, i, min);
+    i = min;
   }
 }
 
-// Does the cell enable tile in the direction?
-static int wfc__tile_enabled(struct wfc *wfc, int tile_idx, int cell_idx, enum wfc__direction d)
+static void wfc__heap_pop(struct wfc *wfc)
 {
-  struct wfc__cell *cell = &( wfc->cells[cell_idx] );
-  int *tiles = cell->tiles;
+  wfc->heap_pos[wfc->heap[0]] = -1;
+  wfc->heap_cnt--;
+  if (wfc->heap_cnt > 0) {
+    wfc->heap[0] = wfc->heap[wfc->heap_cnt];
+    wfc->heap_pos[wfc->heap[0]] = 0;
+    wfc__heap_down(wfc, 0);
+  }
+}
 
-  // Tile is enabled if any of the cell's tiles allowes it in
-  // the specified diretion
-  int tile_cnt = wfc->tile_cnt;
-  for (int i=0, cnt=cell->tile_cnt; i<cnt; i++) {
-    if (wfc->allowed_tiles[d][tiles[i] * tile_cnt + tile_idx]) {
-      return 1;
-    }
+// Puts a cell whose entropy changed either way back into order, pushing
+// it again if it was dropped and has more than one tile once more
+static void wfc__heap_update(struct wfc *wfc, int cell_idx)
+{
+  int i = wfc->heap_pos[cell_idx];
+  if (i < 0) {
+    if (wfc->cells[cell_idx].tile_cnt <= 1)
+      return;
+    i = wfc->heap_cnt++;
+    wfc->heap[i] = cell_idx;
+    wfc->heap_pos[cell_idx] = i;
   }
 
-  return 0;
+  wfc__heap_up(wfc, cell_idx);
+  wfc__heap_down(wfc, wfc->heap_pos[cell_idx]);
 }
 
-// Checks whether particular prop is already added and pending, in which
-// case there is no point of adding the same prop again.
-//
-// 1 - prop is added, 0 - prop is not added
-static int wfc__is_prop_pending(struct wfc *wfc, int cell_idx, enum wfc__direction d) {
-  for (int i=wfc->prop_idx+1; i<wfc->prop_cnt; i++) {
-    struct wfc__prop *p = &( wfc->props[i] );
-    if (p->src_cell_idx == cell_idx && p->direction == d) {
-      return 1;
-    }
+static void wfc__heap_init(struct wfc *wfc)
+{
+  wfc->heap_cnt = wfc->cell_cnt;
+  for (int i=0; i<wfc->cell_cnt; i++) {
+    wfc->heap[i] = i;
+    wfc->heap_pos[i] = i;
   }
-  return 0;
+  for (int i=wfc->cell_cnt/2 - 1; i>=0; i--)
+    wfc__heap_down(wfc, i);
 }
 
-// Updates tiles in the destination cell to those that are allowed by the source cell
-// and propagate updates
+// Removes a tile from a cell and records the removal on the trail, where
+// it waits to be propagated. The tile must be possible in the cell.
 //
-// Return 0 on error
-static int wfc__propagate_prop(struct wfc *wfc, struct wfc__prop *p)
-{
-  int new_cnt = 0;
-
-  struct wfc__cell *dst_cell = &( wfc->cells[ p->dst_cell_idx ] );
-
-  // Go through all destination tiles and check whether they are enabled by the source cell
-  for (int i=0, cnt=dst_cell->tile_cnt; i<cnt; i++) {
-    int possible_dst_tile_idx = dst_cell->tiles[i];
-
-    // If a destination tile is enabled by the source cell, keep it
-    if (wfc__tile_enabled(wfc, possible_dst_tile_idx, p->src_cell_idx, p->direction)) {
-      dst_cell->tiles[new_cnt] = possible_dst_tile_idx;
-      new_cnt++;
-    } else {
-      int freq = wfc->tiles[possible_dst_tile_idx].freq;
-      double p = ((double)freq) / wfc->sum_freqs;
-      dst_cell->entropy += p*log(p);
-      dst_cell->sum_freqs -= freq;
-      if (dst_cell->sum_freqs == 0) // no options left TODO: remove
-        return 0;
-    }
-  }
+// Return 0 if the cell is left without tiles (contradiction)
+static int wfc__ban(struct wfc *wfc, int cell_idx, int tile_idx)
+{
+  struct wfc__cell *cell = &( wfc->cells[cell_idx] );
 
-  if (!new_cnt) {
-    return 0;
-  }
+  cell->tiles[tile_idx / 64] &= ~((uint64_t)1 << (tile_idx % 64));
+  cell->tile_cnt--;
 
-  if (dst_cell->tile_cnt != new_cnt) {
-    if (new_cnt == 1) wfc->collapsed_cell_cnt++;
-    if (p->direction != WFC_DOWN && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_UP)) wfc__add_prop_up(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_UP && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_DOWN)) wfc__add_prop_down(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_RIGHT && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_LEFT)) wfc__add_prop_left(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_LEFT && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_RIGHT)) wfc__add_prop_right(wfc, p->dst_cell_idx);
-  }
+  int freq = wfc->tiles[tile_idx].freq;
+  double p = ((double)freq) / wfc->sum_freqs;
+  cell->entropy += p*log(p);
+  cell->sum_freqs -= freq;
+  wfc__heap_up(wfc, cell_idx);
 
-  dst_cell->tile_cnt = new_cnt;
+  wfc->trail[wfc->trail_cnt++] = cell_idx * wfc->tile_cnt + tile_idx;
 
-  return 1;
+  if (cell->tile_cnt == 1)
+    wfc->collapsed_cell_cnt++;
+
+  return cell->tile_cnt != 0;
 }
 
+// Propagates queued removals. Each removed tile takes away its support
+// from the tiles it allowed in the neighbouring cells, and tiles that are
+// left without support in a direction are removed in turn. A removal is
+// always propagated in full, so that wfc__unban knows which supports to
+// give back.
+//
 // Return 0 on error (contradiction)
-static int wfc__propagate(struct wfc *wfc, int cell_idx)
+static int wfc__propagate(struct wfc *wfc)
 {
-  wfc->prop_cnt = 0;
+  int tile_cnt = wfc->tile_cnt;
+  int words = wfc->words;
+
+  while (wfc->propagated_cnt < wfc->trail_cnt) {
+    int removal = wfc->trail[wfc->propagated_cnt++];
+    int cell_idx = removal / tile_cnt;
+    int tile_idx = removal % tile_cnt;
+    int ok = 1;
+
+    for (int d=0; d<4; d++) {
+      int dst_cell_idx = wfc__neighbour(wfc, cell_idx, d);
+      if (dst_cell_idx == -1)
+        continue;
+
+      uint64_t *allowed = wfc->allowed_tiles[d] + (size_t)tile_idx * words;
+      int *supports = wfc->supports + (size_t)dst_cell_idx * tile_cnt * 4;
+      for (int w=0; w<words; w++) {
+        for (uint64_t bits=allowed[w]; bits; bits &= bits - 1) {
+          int dst_tile_idx = w*64 + __builtin_ctzll(bits);
+          if (--supports[dst_tile_idx*4 + d] == 0 &&
+              wfc__has_tile(wfc, dst_cell_idx, dst_tile_idx) &&
+              !wfc__ban(wfc, dst_cell_idx, dst_tile_idx)) {
+            ok = 0;
+          }
+        }
+      }
+    }
+    if (!ok)
+      return 0;
+  }
 
-  wfc__add_prop_up(wfc, cell_idx);
-  wfc__add_prop_down(wfc, cell_idx);
-  wfc__add_prop_left(wfc, cell_idx);
-  wfc__add_prop_right(wfc, cell_idx);
+  return 1;
+}
 
-  for (int i=0; i<wfc->prop_cnt; i++) {
-    wfc->prop_idx = i;
-    struct wfc__prop *p = &( wfc->props[i] );
-    if (!wfc__propagate_prop(wfc, p)) {
-      return 0;
+// Puts back the last removal on the trail, along with the supports it took
+// away if it was propagated
+static void wfc__unban(struct wfc *wfc)
+{
+  int tile_cnt = wfc->tile_cnt;
+  int words = wfc->words;
+  int removal = wfc->trail[--wfc->trail_cnt];
+  int cell_idx = removal / tile_cnt;
+  int tile_idx = removal % tile_cnt;
+  struct wfc__cell *cell = &( wfc->cells[cell_idx] );
+
+  if (wfc->trail_cnt < wfc->propagated_cnt) {
+    wfc->propagated_cnt = wfc->trail_cnt;
+    for (int d=0; d<4; d++) {
+      int dst_cell_idx = wfc__neighbour(wfc, cell_idx, d);
+      if (dst_cell_idx == -1)
+        continue;
+
+      uint64_t *allowed = wfc->allowed_tiles[d] + (size_t)tile_idx * words;
+      int *supports = wfc->supports + (size_t)dst_cell_idx * tile_cnt * 4;
+      for (int w=0; w<words; w++) {
+        for (uint64_t bits=allowed[w]; bits; bits &= bits - 1)
+          supports[(w*64 + __builtin_ctzll(bits))*4 + d]++;
+      }
     }
   }
 
-  return 1;
+  cell->tiles[tile_idx / 64] |= (uint64_t)1 << (tile_idx % 64);
+  cell->tile_cnt++;
+  if (cell->tile_cnt == 2)
+    wfc->collapsed_cell_cnt--;
+
+  int freq = wfc->tiles[tile_idx].freq;
+  double p = ((double)freq) / wfc->sum_freqs;
+  cell->entropy -= p*log(p);
+  cell->sum_freqs += freq;
+  wfc__heap_update(wfc, cell_idx);
 }
 
-// Return 0 on error (contradiction)
-static int wfc__collapse(struct wfc *wfc, int cell_idx)
+// Undoes the last choice after a contradiction and rules its tile out of
+// the cell instead, going further back if that contradicts as well.
+//
+// Return 0 if there is no choice left to undo, or the limit on backtracks
+// is reached
+static int wfc__backtrack(struct wfc *wfc)
 {
-  int remaining = rand() % wfc->cells[cell_idx].sum_freqs;
-  for (int i=0; i<wfc->cells[cell_idx].tile_cnt; i++) {
-    int freq = wfc->tiles[ wfc->cells[cell_idx].tiles[i] ].freq;
-    if (remaining >= freq) {
-      remaining -= freq;
-    } else {
-      wfc->cells[cell_idx].tiles[0] = wfc->cells[cell_idx].tiles[i];
-      wfc->cells[cell_idx].tile_cnt = 1;
-      wfc->cells[cell_idx].sum_freqs = 0;
-      wfc->cells[cell_idx].entropy = 0;
-      wfc->collapsed_cell_cnt++;
+  while (wfc->choice_cnt > 0 && wfc->backtrack_cnt < WFC_MAX_BACKTRACK_CNT) {
+    struct wfc__choice *choice = &( wfc->choices[--wfc->choice_cnt] );
+    struct wfc__cell *cell = &( wfc->cells[choice->cell_idx] );
+
+    wfc->backtrack_cnt++;
+    while (wfc->trail_cnt > choice->trail_cnt)
+      wfc__unban(wfc);
+    cell->sum_freqs = choice->sum_freqs;
+    cell->entropy = choice->entropy;
+    wfc__heap_update(wfc, choice->cell_idx);
+
+    if (wfc__ban(wfc, choice->cell_idx, choice->tile_idx) && wfc__propagate(wfc))
       return 1;
-    }
   }
 
   return 0;
 }
 
-static int wfc__next_cell(struct wfc *wfc)
+// Return 0 on error (contradiction)
+static int wfc__collapse(struct wfc *wfc, int cell_idx)
 {
-  int min_idx = -1;
-  double min_entropy = DBL_MAX;
+  struct wfc__cell *cell = &( wfc->cells[cell_idx] );
+  int remaining = WFC_RAND(wfc->rand_state) % cell->sum_freqs;
+  int chosen_idx = -1;
+  for (int w=0; w<wfc->words && chosen_idx == -1; w++) {
+    for (uint64_t bits=cell->tiles[w]; bits; bits &= bits - 1) {
+      int tile_idx = w*64 + __builtin_ctzll(bits);
+      int freq = wfc->tiles[tile_idx].freq;
+      if (remaining >= freq) {
+        remaining -= freq;
+      } else {
+        chosen_idx = tile_idx;
+        break;
+      }
+    }
+  }
 
-  for (int i=0; i<wfc->cell_cnt; i++) {
-    // Add small noise to break ties between tiles with the same entropy
-    double entropy = wfc->cells[i].entropy + rand() / (100000.0 * RAND_MAX);
-    if (wfc->cells[i].tile_cnt != 1 && entropy < min_entropy) {
-      min_entropy = entropy;
-      min_idx = i;
+  if (chosen_idx == -1)
+    return 0;
+
+  struct wfc__choice *choice = &( wfc->choices[wfc->choice_cnt++] );
+  choice->cell_idx = cell_idx;
+  choice->tile_idx = chosen_idx;
+  choice->trail_cnt = wfc->trail_cnt;
+  choice->sum_freqs = cell->sum_freqs;
+  choice->entropy = cell->entropy;
+
+  // Remove all the other tiles, so that their removal is propagated
+  for (int w=0; w<wfc->words; w++) {
+    for (uint64_t bits=cell->tiles[w]; bits; bits &= bits - 1) {
+      int tile_idx = w*64 + __builtin_ctzll(bits);
+      if (tile_idx != chosen_idx)
+        wfc__ban(wfc, cell_idx, tile_idx);
     }
   }
+  cell->sum_freqs = 0;
+  cell->entropy = 0;
+
+  return 1;
+}
+
+static int wfc__next_cell(struct wfc *wfc)
+{
+  while (wfc->heap_cnt > 0) {
+    int cell_idx = wfc->heap[0];
+    if (wfc->cells[cell_idx].tile_cnt != 1)
+      return cell_idx;
+    wfc__heap_pop(wfc);
+  }
 
-  return min_idx;
+  return -1;
 }
 
 static void wfc__init_cells(struct wfc *wfc)
@@ -1104,12 +1327,51 @@ static void wfc__init_cells(struct wfc *wfc)
     wfc->cells[i].tile_cnt = wfc->tile_cnt;
     wfc->cells[i].sum_freqs = sum_freqs;
     wfc->cells[i].entropy = entropy;
-    for (int j=0; j<wfc->tile_cnt; j++) {
-      wfc->cells[i].tiles[j] = j;
+    wfc->cells[i].noise = WFC_RAND(wfc->rand_state) / (100000.0 * WFC_RAND_MAX);
+    for (int w=0; w<wfc->words; w++) {
+      int left = wfc->tile_cnt - w*64;
+      wfc->cells[i].tiles[w] = left >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << left) - 1;
+    }
+    memcpy(wfc->supports + (size_t)i * wfc->tile_cnt * 4, wfc->tile_supports,
+           sizeof(*wfc->supports) * wfc->tile_cnt * 4);
+  }
+
+  wfc->trail_cnt = 0;
+  wfc->propagated_cnt = 0;
+  wfc->choice_cnt = 0;
+  wfc->backtrack_cnt = 0;
+  wfc->contradiction = 0;
+  wfc__heap_init(wfc);
+
+  // Tiles that nothing allows in direction d of another can only be placed
+  // where there is no cell to support them from, the one that d leads from
+  for (int i=0; i<wfc->cell_cnt; i++) {
+    for (int d=0; d<4; d++) {
+      if (wfc__neighbour(wfc, i, wfc__opposite(d)) == -1)
+        continue;
+      for (int j=0; j<wfc->tile_cnt; j++) {
+        if (wfc->tile_supports[j*4 + d] == 0 && wfc__has_tile(wfc, i, j) && !wfc__ban(wfc, i, j))
+          wfc->contradiction = 1;
+      }
     }
   }
+}
 
-  wfc->prop_cnt = 0;
+// Counts for each tile and direction how many tiles allow it
+static void wfc__init_tile_supports(struct wfc *wfc)
+{
+  int words = wfc->words;
+  for (int d=0; d<4; d++) {
+    for (int j=0; j<wfc->tile_cnt; j++)
+      wfc->tile_supports[j*4 + d] = 0;
+    for (int i=0; i<wfc->tile_cnt; i++) {
+      uint64_t *allowed = wfc->allowed_tiles[d] + (size_t)i * words;
+      for (int w=0; w<words; w++) {
+        for (uint64_t bits=allowed[w]; bits; bits &= bits - 1)
+          wfc->tile_supports[(w*64 + __builtin_ctzll(bits))*4 + d]++;
+      }
+    }
+  }
 }
 
 // Allows to call wfc_run again
@@ -1126,21 +1388,37 @@ void wfc_init(struct wfc *wfc)
 
 // max_collapse_cnt of -1 means no iteration number limit
 //
-// Return 0 on error (contradiction occurred)
+// Another thread can stop the run early through the flag given to
+// wfc_set_cancel, which makes it fail.
+//
+// A contradiction undoes the choices that led to it, one at a time, until
+// there is a tile left to try, up to WFC_MAX_BACKTRACK_CNT times.
+//
+// Return 0 on error (contradiction occurred and backtracking failed)
 int wfc_run(struct wfc *wfc, int max_collapse_cnt)
 {
   //int cell_idx = (wfc->output_height / 2) * wfc->output_width + wfc->output_width / 2;
-  int cell_idx = rand() % (wfc->output_height * wfc->output_width);
+  int cell_idx = WFC_RAND(wfc->rand_state) % (wfc->output_height * wfc->output_width);
+
+  // Removals made before the run, by wfc_init, are propagated first. There
+  // is no choice to undo if they contradict.
+  if (wfc->contradiction || !wfc__propagate(wfc))
+    return 0;
 
   while (1) {
     print_progress(wfc->collapsed_cell_cnt);
 
+    if (wfc->cancel != NULL && __atomic_load_n(wfc->cancel, __ATOMIC_RELAXED)) {
+      print_endprogress();
+      return 0;
+    }
+
     if (!wfc__collapse(wfc, cell_idx)) {
       print_endprogress();
       return 0;
     }
 
-    if (!wfc__propagate(wfc, cell_idx)) {
+    if (!wfc__propagate(wfc) && !wfc__backtrack(wfc)) {
       print_endprogress();
       return 0;
     }
@@ -1158,29 +1436,195 @@ int wfc_run(struct wfc *wfc, int max_collapse_cnt)
   return 1;
 }
 
+void wfc_set_rand_state(struct wfc *wfc, void *rand_state)
+{
+  wfc->rand_state = rand_state;
+}
+
+void wfc_set_cancel(struct wfc *wfc, const int *cancel)
+{
+  wfc->cancel = cancel;
+}
+
+// Leaves tile_idx the only tile possible in a cell, so that wfc_run starts
+// from it. The removals are propagated when wfc_run begins, and wfc_init
+// undoes them.
+//
+// Return 0 if the tile was not possible in the cell (contradiction)
+int wfc_fix_tile(struct wfc *wfc, int x, int y, int tile_idx)
+{
+  int cell_idx = y * wfc->output_width + x;
+  struct wfc__cell *cell = &( wfc->cells[cell_idx] );
+  int ok = wfc__has_tile(wfc, cell_idx, tile_idx);
+
+  for (int w=0; w<wfc->words; w++) {
+    for (uint64_t bits=cell->tiles[w]; bits; bits &= bits - 1) {
+      int idx = w*64 + __builtin_ctzll(bits);
+      if (idx != tile_idx)
+        wfc__ban(wfc, cell_idx, idx);
+    }
+  }
+  if (!ok)
+    wfc->contradiction = 1;
+
+  return ok;
+}
+
+// Leaves only the tiles of a bitset possible in a cell. Like wfc_fix_tile,
+// for cells that are limited rather than fixed.
+//
+// Return 0 if no tile is left in the cell (contradiction)
+int wfc_restrict_tiles(struct wfc *wfc, int x, int y, const uint64_t *tiles)
+{
+  int cell_idx = y * wfc->output_width + x;
+  struct wfc__cell *cell = &( wfc->cells[cell_idx] );
+
+  for (int w=0; w<wfc->words; w++) {
+    for (uint64_t bits=cell->tiles[w] & ~tiles[w]; bits; bits &= bits - 1)
+      wfc__ban(wfc, cell_idx, w*64 + __builtin_ctzll(bits));
+  }
+  if (cell->tile_cnt == 0)
+    wfc->contradiction = 1;
+
+  return cell->tile_cnt != 0;
+}
+
+// Return the tile of a cell that has collapsed, or -1 if it has not
+int wfc_tile_at(struct wfc *wfc, int x, int y)
+{
+  int cell_idx = y * wfc->output_width + x;
+  if (wfc->cells[cell_idx].tile_cnt != 1)
+    return -1;
+
+  return wfc__first_tile(wfc, cell_idx);
+}
+
+int wfc_backtrack_cnt(struct wfc *wfc)
+{
+  return wfc->backtrack_cnt;
+}
+
 void wfc_destroy(struct wfc *wfc)
 {
+  if (wfc == NULL)
+    return;
+
   wfc__destroy_cells(wfc->cells, wfc->cell_cnt);
-  wfc__destroy_tiles(wfc->tiles, wfc->tile_cnt);
-  wfc__destroy_allowed_tiles(wfc->allowed_tiles);
-  wfc__destroy_props(wfc->props);
+  wfc_rules_destroy(wfc->own_rules);
+  free(wfc->supports);
+  free(wfc->tile_supports);
+  free(wfc->trail);
+  free(wfc->choices);
+  free(wfc->heap);
+  free(wfc->heap_pos);
   free(wfc);
 }
 
+void wfc_rules_destroy(struct wfc_rules *rules)
+{
+  if (rules == NULL)
+    return;
+
+  wfc__destroy_tiles(rules->tiles, rules->tile_cnt);
+  wfc__destroy_allowed_tiles(rules->allowed_tiles);
+  free(rules);
+}
+
+int wfc_rules_words(const struct wfc_rules *rules)
+{
+  return rules->words;
+}
+
+// A tile outputs its top left pixel
+int wfc_rules_pixel_tiles(const struct wfc_rules *rules,
+                          const unsigned char *pixels,
+                          int pixel_cnt,
+                          uint64_t *tiles)
+{
+  int cc = rules->component_cnt;
+  int cnt = 0;
+
+  memset(tiles, 0, sizeof(*tiles) * rules->words);
+  for (int i=0; i<rules->tile_cnt; i++) {
+    for (int j=0; j<pixel_cnt; j++) {
+      if (!memcmp(rules->tiles[i].image->data, pixels + j*cc, cc)) {
+        tiles[i / 64] |= (uint64_t)1 << (i % 64);
+        cnt++;
+        break;
+      }
+    }
+  }
+
+  return cnt;
+}
+
+#define WFC__ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+// Bytes needed to hold a copy of the rules made by wfc_rules_copy
+size_t wfc_rules_size(const struct wfc_rules *rules)
+{
+  size_t tile_size = (size_t)rules->tile_width * rules->tile_height * rules->component_cnt;
+
+  return WFC__ALIGN(sizeof(*rules)) +
+    WFC__ALIGN(sizeof(*rules->tiles) * rules->tile_cnt) +
+    WFC__ALIGN(sizeof(struct wfc_image) * rules->tile_cnt) +
+    WFC__ALIGN(sizeof(uint64_t) * rules->tile_cnt * rules->words * 4) +
+    WFC__ALIGN(tile_size * rules->tile_cnt);
+}
+
+// Copy the rules, with their tiles, into a single block of
+// wfc_rules_size bytes. The copy points only into the block, so a block
+// that stays at the same address, such as a file mapped at a fixed
+// address, can be used without any fixing up.
+//
+// Return the copy
+struct wfc_rules *wfc_rules_copy(const struct wfc_rules *rules, void *dst)
+{
+  size_t tile_size = (size_t)rules->tile_width * rules->tile_height * rules->component_cnt;
+  size_t allowed_cnt = (size_t)rules->tile_cnt * rules->words;
+  unsigned char *next = dst;
+
+  struct wfc_rules *copy = (struct wfc_rules *)next;
+  next += WFC__ALIGN(sizeof(*rules));
+  *copy = *rules;
+
+  copy->tiles = (struct wfc__tile *)next;
+  next += WFC__ALIGN(sizeof(*rules->tiles) * rules->tile_cnt);
+  struct wfc_image *images = (struct wfc_image *)next;
+  next += WFC__ALIGN(sizeof(struct wfc_image) * rules->tile_cnt);
+
+  for (int d=0; d<4; d++)
+    copy->allowed_tiles[d] = (uint64_t *)next + d * allowed_cnt;
+  memcpy(copy->allowed_tiles[0], rules->allowed_tiles[0], sizeof(uint64_t) * allowed_cnt * 4);
+  next += WFC__ALIGN(sizeof(uint64_t) * allowed_cnt * 4);
+
+  for (int i=0; i<rules->tile_cnt; i++) {
+    images[i] = *rules->tiles[i].image;
+    images[i].data = next + i * tile_size;
+    memcpy(images[i].data, rules->tiles[i].image->data, tile_size);
+    copy->tiles[i].image = &images[i];
+    copy->tiles[i].freq = rules->tiles[i].freq;
+  }
+
+  return copy;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // WFC: Overlapping method
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-static void wfc__compute_allowed_tiles(int *allowed_tiles[4], struct wfc__tile *tiles, int tile_cnt)
+static void wfc__compute_allowed_tiles(uint64_t *allowed_tiles[4], struct wfc__tile *tiles, int tile_cnt)
 {
+  int words = WFC__WORDS(tile_cnt);
   for (int d=0; d<4; d++) {
     for (int i=0; i<tile_cnt; i++) {
       for (int j=0; j<tile_cnt; j++) {
         //if (i==j)
         //  continue;
-        allowed_tiles[d][i*tile_cnt + j] = wfc__img_cmpoverlap(tiles[i].image, tiles[j].image, d);
+        if (wfc__img_cmpoverlap(tiles[i].image, tiles[j].image, d))
+          allowed_tiles[d][i*words + j/64] |= (uint64_t)1 << (j % 64);
       }
     }
   }
@@ -1261,72 +1705,151 @@ CLEANUP:
 }
 
 // Return NULL on error
-struct wfc *wfc_overlapping(int output_width,
-                            int output_height,
-                            struct wfc_image *image,
-                            int tile_width,
-                            int tile_height,
-                            int expand_input,
-                            int xflip_tiles,
-                            int yflip_tiles,
-                            int rotate_tiles)
+struct wfc_rules *wfc_overlapping_rules(struct wfc_image *image,
+                                        int tile_width,
+                                        int tile_height,
+                                        int expand_input,
+                                        int xflip_tiles,
+                                        int yflip_tiles,
+                                        int rotate_tiles)
+{
+  struct wfc_rules *rules = malloc(sizeof(*rules));
+  if (rules == NULL)
+    goto CLEANUP;
+
+  rules->tile_width = tile_width;
+  rules->tile_height = tile_height;
+  rules->component_cnt = image->component_cnt;
+  rules->tile_cnt = 0;
+  rules->words = 0;
+  rules->allowed_tiles[0] = NULL;
+
+  rules->tiles = wfc__create_tiles_overlapping(image,
+                                               tile_width,
+                                               tile_height,
+                                               expand_input,
+                                               xflip_tiles,
+                                               yflip_tiles,
+                                               rotate_tiles,
+                                               &rules->tile_cnt);
+  if (rules->tiles == NULL)
+    goto CLEANUP;
+  rules->words = WFC__WORDS(rules->tile_cnt);
+
+  if (!wfc__create_allowed_tiles(rules->allowed_tiles, rules->tile_cnt)) {
+      goto CLEANUP;
+    }
+  wfc__compute_allowed_tiles(rules->allowed_tiles, rules->tiles, rules->tile_cnt);
+
+  return rules;
+
+ CLEANUP:
+  p("wfc_overlapping_rules: error\n");
+  wfc_rules_destroy(rules);
+  return NULL;
+}
+
+// Return NULL on error
+struct wfc *wfc_from_rules(int output_width,
+                           int output_height,
+                           const struct wfc_rules *rules,
+                           void *rand_state)
 {
   struct wfc *wfc = malloc(sizeof(*wfc));
   if (wfc == NULL)
     goto CLEANUP;
 
   wfc->method = WFC_METHOD_OVERLAPPING;
-  wfc->image = image;
+  wfc->rand_state = rand_state;
+  wfc->cancel = NULL;
+  wfc->image = NULL;
   wfc->cells = NULL;
-  wfc->tiles = NULL;
-  wfc->props = NULL;
+  wfc->supports = NULL;
+  wfc->tile_supports = NULL;
+  wfc->trail = NULL;
+  wfc->choices = NULL;
+  wfc->heap = NULL;
+  wfc->heap_pos = NULL;
+  wfc->rules = rules;
+  wfc->own_rules = NULL;
+  wfc->tiles = rules->tiles;
+  wfc->tile_cnt = rules->tile_cnt;
+  wfc->words = rules->words;
+  for (int d=0; d<4; d++)
+    wfc->allowed_tiles[d] = rules->allowed_tiles[d];
   wfc->output_width = output_width;
   wfc->output_height = output_height;
   wfc->cell_cnt = output_width * output_height;
-  wfc->tile_width = tile_width;
-  wfc->tile_height = tile_height;
-  wfc->tile_cnt = 0;
-  wfc->expand_input = expand_input;
-  wfc->xflip_tiles = xflip_tiles;
-  wfc->yflip_tiles = yflip_tiles;
-  wfc->rotate_tiles = rotate_tiles;
-  // use entropy
-  // ...
-
-  wfc->tiles = wfc__create_tiles_overlapping(wfc->image,
-                                             wfc->tile_width,
-                                             wfc->tile_height,
-                                             wfc->expand_input,
-                                             wfc->xflip_tiles,
-                                             wfc->yflip_tiles,
-                                             rotate_tiles,
-                                             &wfc->tile_cnt);
-  if (wfc->tiles == NULL)
-    goto CLEANUP;
-
-  if (!wfc__create_allowed_tiles(wfc->allowed_tiles, wfc->tile_cnt)) {
-      goto CLEANUP;
-    }
-  wfc__compute_allowed_tiles(wfc->allowed_tiles, wfc->tiles, wfc->tile_cnt);
+  wfc->tile_width = rules->tile_width;
+  wfc->tile_height = rules->tile_height;
+  wfc->expand_input = 0;
+  wfc->xflip_tiles = 0;
+  wfc->yflip_tiles = 0;
+  wfc->rotate_tiles = 0;
 
   wfc->cells = wfc__create_cells(wfc->cell_cnt, wfc->tile_cnt);
   if (wfc->cells == NULL)
     goto CLEANUP;
 
-  wfc->props = wfc__create_props(wfc->cell_cnt);
-  if (wfc->props == NULL)
+  size_t cell_tile_cnt = (size_t)wfc->cell_cnt * wfc->tile_cnt;
+  wfc->supports = malloc(sizeof(*wfc->supports) * cell_tile_cnt * 4);
+  wfc->tile_supports = malloc(sizeof(*wfc->tile_supports) * wfc->tile_cnt * 4);
+  wfc->trail = malloc(sizeof(*wfc->trail) * cell_tile_cnt);
+  wfc->choices = malloc(sizeof(*wfc->choices) * wfc->cell_cnt);
+  wfc->heap = malloc(sizeof(*wfc->heap) * wfc->cell_cnt);
+  wfc->heap_pos = malloc(sizeof(*wfc->heap_pos) * wfc->cell_cnt);
+  if (wfc->supports == NULL || wfc->tile_supports == NULL || wfc->trail == NULL ||
+      wfc->choices == NULL || wfc->heap == NULL || wfc->heap_pos == NULL)
     goto CLEANUP;
+  wfc__init_tile_supports(wfc);
 
   wfc_init(wfc);
 
   return wfc;
 
  CLEANUP:
-  p("wfc_overlapping: error\n");
+  p("wfc_from_rules: error\n");
   wfc_destroy(wfc);
   return NULL;
 }
 
+// Return NULL on error
+struct wfc *wfc_overlapping(int output_width,
+                            int output_height,
+                            struct wfc_image *image,
+                            int tile_width,
+                            int tile_height,
+                            int expand_input,
+                            int xflip_tiles,
+                            int yflip_tiles,
+                            int rotate_tiles)
+{
+  struct wfc_rules *rules = wfc_overlapping_rules(image,
+                                                  tile_width,
+                                                  tile_height,
+                                                  expand_input,
+                                                  xflip_tiles,
+                                                  yflip_tiles,
+                                                  rotate_tiles);
+  if (rules == NULL)
+    return NULL;
+
+  struct wfc *wfc = wfc_from_rules(output_width, output_height, rules, NULL);
+  if (wfc == NULL) {
+    wfc_rules_destroy(rules);
+    return NULL;
+  }
+
+  wfc->image = image;
+  wfc->own_rules = rules;
+  wfc->expand_input = expand_input;
+  wfc->xflip_tiles = xflip_tiles;
+  wfc->yflip_tiles = yflip_tiles;
+  wfc->rotate_tiles = rotate_tiles;
+
+  return wfc;
+}
+
 #endif // WFC_IMPLEMENTATION
 
 #pragma GCC diagnostic pop
@@ -4,34 +4,84 @@
 #include <curses.h>
 #include <panel.h>
 
+struct actor;
+struct menu;
+
 struct zz_win {
     WINDOW *win;
     PANEL *panel;
 };
 
+/* A single map cell, as handed to map_put_row(). */
+struct glyph {
+    int chr;
+    unsigned char color;
+};
+
+/* The functions a windowport provides to the rest of the game. The active
+   windowport is chosen at runtime by copying one of the tables below into
+   windowprocs, and the game calls into it through the macros that follow. */
+struct window_procs {
+    const char *name;
+    int has_display; /* Zero if the windowport draws nothing at all. */
+    void (*win_setup_screen)(void);
+    void (*win_cleanup_screen)(void);
+    void (*win_title_screen)(void);
+    void (*win_setup_gui)(void);
+    void (*win_flush_screen)(void);
+    void (*win_text_entry)(const char *, char *, int);
+    void (*win_display_file_text)(const char *);
+    void (*win_display_sb)(void);
+    void (*win_draw_msg_window)(int);
+    void (*win_draw_lifebars)(void);
+    int (*win_map_put_tile)(int, int, int, int, int);
+    int (*win_map_put_actor)(int, int, struct actor *, int);
+    int (*win_map_putch)(int, int, int, int);
+    int (*win_map_putch_truecolor)(int, int, int, unsigned);
+    int (*win_map_put_row)(int, int, const struct glyph *, int);
+    void (*win_clear_map)(void);
+    void (*win_refresh_map)(void);
+    void (*win_scroll_map)(int, int);
+    int (*win_handle_keys)(void);
+    struct menu *(*win_menu_new)(const char *, int, int, int, int);
+    void (*win_menu_add_item)(struct menu *, unsigned char, const char *);
+    signed char (*win_menu_do_choice)(struct menu *, int);
+    void (*win_menu_destroy)(struct menu *);
+};
+
+extern struct window_procs windowprocs;
+extern struct window_procs curses_procs;
+extern struct window_procs headless_procs;
+
+#define setup_screen (*windowprocs.win_setup_screen)
+#define cleanup_screen (*windowprocs.win_cleanup_screen)
+#define title_screen (*windowprocs.win_title_screen)
+#define setup_gui (*windowprocs.win_setup_gui)
+#define flush_screen (*windowprocs.win_flush_screen)
+#define text_entry (*windowprocs.win_text_entry)
+#define display_file_text (*windowprocs.win_display_file_text)
+#define display_sb (*windowprocs.win_display_sb)
+#define draw_msg_window (*windowprocs.win_draw_msg_window)
+#define draw_lifebars (*windowprocs.win_draw_lifebars)
+#define map_put_tile (*windowprocs.win_map_put_tile)
+#define map_put_actor (*windowprocs.win_map_put_actor)
+#define map_putch (*windowprocs.win_map_putch)
+#define map_putch_truecolor (*windowprocs.win_map_putch_truecolor)
+#define map_put_row (*windowprocs.win_map_put_row)
+#define clear_map (*windowprocs.win_clear_map)
+#define refresh_map (*windowprocs.win_refresh_map)
+#define scroll_map (*windowprocs.win_scroll_map)
+#define handle_keys (*windowprocs.win_handle_keys)
+
 /* Function Prototypes */
+struct actor *win_pick_invent(void);
+void headless_set_input(const char *);
+
+/* Helpers shared within the curses windowport */
 void wcolor_on(WINDOW *, unsigned char);
 void wcolor_off(WINDOW *, unsigned char);
-void title_screen(void);
-void setup_gui(void);
 struct zz_win create_win(int, int, int, int);
 void cleanup_win(struct zz_win);
-void setup_screen(void);
-void cleanup_screen(void);
-void text_entry(const char *, char *, int);
-void display_file_text(const char *);
-void display_sb(void);
-int fullscreen_action(void);
-void draw_msg_window(int);
-void draw_lifebars(void);
-int map_put_tile(int, int, int, int, int);
-int map_put_actor(int, int, struct actor *, int);
-int map_putch(int, int, int, int);
-int map_putch_truecolor(int, int, int, unsigned);
-void clear_map(void);
-void refresh_map(void);
-int handle_keys(void);
-struct actor *win_pick_invent(void);
 
 #define HUD_MODE_CHAR 0
 #define HUD_MODE_HELP 1
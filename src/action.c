@@ -27,6 +27,7 @@
 #include "invent.h"
 #include "spawn.h"
 #include "ai.h"
+#include "journal.h"
 
 int display_structinfo(void);
 int do_nothing(void);
@@ -36,6 +37,7 @@ struct action *travel(void);
 int look_down(void);
 int lookmode(void);
 int display_help(void);
+int fullscreen_action(void);
 int list_actions_exec(void);
 int change_hud_mode(void);
 int climb(struct actor *, int);
@@ -427,6 +429,16 @@ int display_help(void) {
     return 0;
 }
 
+/**
+ * @brief Action that fullscrens the message window.
+ * 
+ * @return int Cost of fullscreening.
+ */
+int fullscreen_action(void) {
+    draw_msg_window(1);
+    return 0;
+}
+
 /**
  * @brief Determine the action that the player will be taking. Blocks input.
  * 
@@ -499,7 +511,7 @@ struct action *dir_to_action(int x, int y) {
 
 struct coord action_to_dir(struct action *action) {
     if (action->index >= A_REST)
-        return act_dir_array[A_REST];
+        return act_dir_array[A_NONE];
     return act_dir_array[action->index];
 }
 
@@ -512,17 +524,20 @@ struct coord action_to_dir(struct action *action) {
  */
 int execute_action(struct actor *actor, struct action *action) {
     struct coord move_coord;
+    int cost;
     if (action->index != A_NONE && actor == g.player) g.prev_action = action;
+    if (actor == g.player) journal_begin(action);
     // Autoexploring code goes here????
     if (action->movement) {
         move_coord = action_to_dir(action);
-        return action->func.dir_act(actor, move_coord.x, move_coord.y);
+        cost = action->func.dir_act(actor, move_coord.x, move_coord.y);
     } else if (action->directed) {
-        return action->func.dir_act(actor, actor->x, actor->y);
+        cost = action->func.dir_act(actor, actor->x, actor->y);
     } else {
-        return action->func.void_act();
+        cost = action->func.void_act();
     }
-    return do_nothing();
+    if (actor == g.player) journal_end(action);
+    return cost;
 }
 
 /**
@@ -176,17 +176,21 @@ void actor_sanity_checks(struct actor *actor) {
 int free_actor(struct actor *actor) {
     int count = 1;
     int target = (actor == g.target);
-    if (actor->name)
-        free(actor->name);
     if (actor->invent)
         count += free_actor_list(actor->invent);
-    if (actor->ai)
-        free(actor->ai);
-    if (actor->item)
-        free(actor->item);
-    if (actor->equip)
-        free(actor->equip);
-    free(actor);
+    /* Actors restored from a save share one block with their components,
+       which is released all at once. */
+    if (!actor->pooled) {
+        if (actor->name)
+            free(actor->name);
+        if (actor->ai)
+            free(actor->ai);
+        if (actor->item)
+            free(actor->item);
+        if (actor->equip)
+            free(actor->equip);
+        free(actor);
+    }
     actor = NULL;
     if (target) g.target = NULL;
     return count;
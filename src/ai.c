@@ -23,6 +23,8 @@
 #include "combat.h"
 #include "spawn.h"
 #include "mapgen.h"
+#include "save.h"
+#include "journal.h"
 
 int check_stealth(struct actor *, struct actor *);
 void increment_regular_values(struct actor *);
@@ -92,7 +94,12 @@ void take_turn(struct actor *actor) {
     if (actor != g.player && !actor->ai)
         return;
     
-    increment_regular_values(actor);
+    /* A loaded game resumes partway through the player's turn, after the
+       turn's regular values were already incremented. */
+    if (actor == g.player && f.resume_turn)
+        f.resume_turn = 0;
+    else
+        increment_regular_values(actor);
 
     while (actor->energy > 0) {
         actor->can_tech = 0;
@@ -102,6 +109,8 @@ void take_turn(struct actor *actor) {
         actor->combo_counter = 0;
         actor->old_stance = actor->stance;
         if (actor == g.player) {
+            journal_flush();
+            autosave();
             render_all();
             /* Player input */
             action = get_action();
@@ -146,7 +155,7 @@ struct attack choose_attack(struct actor *aggressor, struct actor *target) {
             break;
     }
     if (i == 1) return aggressor->attacks[0];
-    j = rndmx(i);
+    j = rndmx(RNG_AI, i);
     return aggressor->attacks[j];
 }
 
@@ -172,7 +181,7 @@ void make_aware(struct actor *aggressor, struct actor *target, int silent) {
     if (aggressor->ai) {
         if (!silent)
             logm("%s %s %s%s", actor_name(aggressor, NAME_A | NAME_CAP),
-                spot_msgs[rndmx(MAX_SPOT_MSG)],
+                spot_msgs[rndmx(RNG_AI, MAX_SPOT_MSG)],
                 actor_name(target, NAME_THE),
                 in_danger(g.player) ? "!" : "." );
         aggressor->ai->seekcur = aggressor->ai->seekdef;
@@ -183,7 +192,7 @@ void make_aware(struct actor *aggressor, struct actor *target, int silent) {
 int check_stealth(struct actor *aggressor, struct actor *target) {
     (void) aggressor;
     if (is_visible(target->x, target->y) && is_visible(aggressor->x, aggressor->y)
-        && !rndmx(2))
+        && !rndmx(RNG_AI, 2))
         make_aware(aggressor, target, 0);
     return 0;
 }
@@ -222,7 +222,7 @@ int attack_roll(struct actor *aggressor, struct actor *target, struct attack *at
         goal = 100;
     }
 
-    return (rndrng(1, 101) <= goal);
+    return (rndrng(RNG_COMBAT, 1, 101) <= goal);
 }
 
 /**
@@ -0,0 +1,829 @@
+/**
+ * @file datapack.c
+ * @brief The data pack. Every creature, item and wfc definition, compiled
+ ahead of time into one binary file that is mapped in at startup instead of
+ parsing the JSON. The JSON is still read if the pack is missing, older than
+ the JSON, or from another version of the game, in which case the data files
+ are parsed in parallel. Ahead of the pack comes the data image, which holds
+ the same definitions and the compiled wfc rules ready to use in place, and
+ is shared between every game running on the machine.
+ * @version 1.0
+ * 
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "datapack.h"
+#include "parser.h"
+#include "save.h"
+#include "actor.h"
+#include "ai.h"
+#include "invent.h"
+#include "mapgen.h"
+#include "register.h"
+#include "message.h"
+
+struct data_image;
+
+int pack_is_stale(const struct stat *);
+int map_data_pack(const char *, struct save_buf *, unsigned long *);
+int check_pack_sections(struct save_buf *);
+int decode_actor_section(struct save_buf *, int *, struct actor **);
+void shuffle_section(int, int, int, int);
+int image_is_usable(const struct stat *, const struct data_image *);
+size_t data_image_size(struct save_buf *, const unsigned long *, struct wfc_rules **);
+int write_data_image(const char *, struct save_buf *, const unsigned long *, struct wfc_rules **, size_t);
+void load_data_files(void);
+void *parse_batches(void *);
+void merge_batch(struct actor **, int, int *, struct actor **);
+
+/* Every data file, in the order the game loads them. Actor ids are indices
+   into g.monsters and g.items, so the order must not change between the
+   pack being built and it being loaded. */
+const struct data_file data_files[] = {
+    { "data/creature/characters.json", DATA_MONSTERS },
+    { "data/creature/boxers.json",     DATA_MONSTERS },
+    { "data/creature/employees.json",  DATA_MONSTERS },
+    { "data/creature/debug.json",      DATA_MONSTERS },
+    { "data/item/weapons.json",        DATA_ITEMS },
+    { "data/wfc/dungeon.json",         DATA_WFC },
+    { "data/wfc/dungeon_big.json",     DATA_WFC },
+};
+const int num_data_files = sizeof(data_files) / sizeof(data_files[0]);
+
+/* Pack layout. A fixed header holding the magic, the pack version, the
+   version of the actor records and how many actors and components of each
+   kind the pack holds, like a save's header. Then one section per data file,
+   in the order of data_files: the file's name and the length of the rest of
+   the section, followed by either the SHUFFLE_* flags, the actor count and
+   the actor records, or the width, height and cells of a wfc image. */
+static const unsigned char pack_magic[4] = { 'Z', 'Z', 'D', 'P' };
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE (8 + 4 * POOL_MAX)
+
+/* The data image. Unlike the pack, it holds the definitions exactly as
+   they sit in memory, pointers and all, laid out for a fixed address. A
+   game that can map the image at that address uses it in place, so nothing
+   is parsed, decoded or allocated, and the pages are shared with every
+   other game that has the image mapped until a game writes to one of them.
+   The header comes first, then a section per data file, then the actors
+   and the wfc images and rules that the sections point to. */
+static const unsigned char image_magic[4] = { 'Z', 'Z', 'D', 'I' };
+#define IMAGE_VERSION 2
+#define IMAGE_BASE ((uintptr_t) 0x200000000000)
+
+/* Keep everything in the image aligned for any type it holds. */
+#define IMAGE_ALIGN(n) (((n) + 15) & ~(size_t) 15)
+
+/* What the image holds for a data file. */
+struct image_section {
+    char fname[64];
+    int start, end; /* The range of g.monsters or g.items it fills. */
+    int shuffle;
+    struct wfc_image wfc_image;
+    struct wfc_rules *wfc_rules;
+};
+
+struct data_image {
+    unsigned char magic[4];
+    unsigned short version;
+    unsigned short save_version;
+    uintptr_t base;
+    size_t size;
+    /* The sizes of the structs, which must match the game's. */
+    size_t layout[POOL_MAX + 1];
+    int num_sections;
+    struct image_section *sections;
+    int total_monsters, total_items;
+    struct actor *monsters[MAX_ACTORS];
+    struct actor *items[MAX_ACTORS];
+};
+
+static const size_t image_layout[POOL_MAX + 1] = {
+    sizeof(struct actor),
+    sizeof(struct name),
+    sizeof(struct ai),
+    sizeof(struct item),
+    sizeof(struct equip),
+    sizeof(struct data_image)
+};
+
+#ifndef MAP_FIXED_NOREPLACE
+/* Without it the address is only a hint, which is checked all the same. */
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+/* The wfc images, by data file. They point either into the pack or the
+   image, which stay mapped for as long as the game runs, or to images
+   parsed from the JSON, which are kept just as long. */
+static struct wfc_image *wfc_images = NULL;
+
+/* The compiled wfc rules, by data file. They point into the image if it
+   was loaded, and are otherwise compiled the first time they are asked for
+   and kept for as long as the game runs. */
+static struct wfc_rules **wfc_rules = NULL;
+
+/* A data file parsed by one of the loader threads, waiting to be merged. */
+struct data_batch {
+    struct actor *actors[MAX_ACTORS];
+    int count;
+    int shuffle; /* -1 if the file could not be read. */
+};
+
+/* The most threads that data files are parsed on, counting the main one. */
+#define MAX_LOADERS 4
+
+static struct data_batch *batches = NULL;
+static int next_batch = 0;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Load every creature and item definition into g.monsters and
+ g.items, from the data image or the data pack if either can be used and from
+ the JSON otherwise.
+ * 
+ */
+void load_game_data(void) {
+    if (load_data_image(DATA_IMAGE) && load_data_pack(DATA_PACK))
+        load_data_files();
+}
+
+/**
+ * @brief Parse every data file, spread over a few threads that each take the
+ next unparsed file until none are left, so that loading takes about as long
+ as the largest file rather than all of them. The results are then merged in
+ the order of data_files, exactly as if the files had been parsed one at a
+ time.
+ * 
+ */
+void load_data_files(void) {
+    pthread_t threads[MAX_LOADERS - 1];
+    struct actor **actor_array;
+    int *total_actors;
+    int start;
+    int nthreads = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = min(min(num_data_files, MAX_LOADERS), max(ncpus, 1)) - 1;
+
+    batches = calloc(num_data_files, sizeof(struct data_batch));
+    wfc_images = calloc(num_data_files, sizeof(struct wfc_image));
+    if (batches == NULL || wfc_images == NULL)
+        panik("Ran out of memory while loading the data files.\n");
+    next_batch = 0;
+    while (nthreads < want && !pthread_create(&threads[nthreads], NULL, parse_batches, NULL))
+        nthreads++;
+    /* The main thread pitches in too, and copes on its own if no threads
+       could be started. */
+    parse_batches(NULL);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < num_data_files; i++) {
+        if (data_files[i].kind == DATA_WFC)
+            continue;
+        if (batches[i].shuffle < 0)
+            panik("Could not read json file: %s\n", data_files[i].fname);
+        actor_array = data_files[i].kind == DATA_MONSTERS ? g.monsters : g.items;
+        total_actors = data_files[i].kind == DATA_MONSTERS ? &g.total_monsters : &g.total_items;
+        start = *total_actors;
+        merge_batch(batches[i].actors, batches[i].count, total_actors, actor_array);
+        /* Shuffle the subsection of the array that we read in (if needed) */
+        if (batches[i].shuffle)
+            shuffle_attributes(actor_array, start, *total_actors, batches[i].shuffle & SHUFFLE_APPEARANCE,
+                               batches[i].shuffle & SHUFFLE_COLOR);
+    }
+    free(batches);
+    batches = NULL;
+}
+
+/**
+ * @brief Parse data files into their batches until every file has been
+ taken. Run by each loader thread.
+ * 
+ * @param arg Unused.
+ * @return void* NULL.
+ */
+void *parse_batches(void *arg) {
+    struct wfc_image image;
+    int i;
+
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&batch_lock);
+        i = next_batch++;
+        pthread_mutex_unlock(&batch_lock);
+        if (i >= num_data_files)
+            return NULL;
+        if (data_files[i].kind == DATA_WFC) {
+            /* A missing image is reported when a level asks for it. */
+            image = parse_wfc_json(data_files[i].fname);
+            if (image.width && image.height)
+                wfc_images[i] = image;
+            else
+                free(image.data);
+        } else {
+            batches[i].shuffle = parse_actor_file(data_files[i].fname, &batches[i].count,
+                                                  batches[i].actors);
+        }
+    }
+}
+
+/**
+ * @brief Append a batch of actors to an actor array, renumbering them to
+ match their new place.
+ * 
+ * @param batch The batch of actors.
+ * @param count The number of actors in the batch.
+ * @param total_actors pointer to the count of total actors
+ * @param actor_array pointer to the array to be written to
+ */
+void merge_batch(struct actor **batch, int count, int *total_actors, struct actor **actor_array) {
+    for (int i = 0; i < count; i++) {
+        if (*total_actors >= MAX_ACTORS) {
+            logm_warning("MAX_ACTORS exceeded. Termination of game is recommended.");
+            for (; i < count; i++)
+                free_actor(batch[i]);
+            return;
+        }
+        batch[i]->id = *total_actors;
+        actor_array[(*total_actors)++] = batch[i];
+    }
+}
+
+/**
+ * @brief Check whether any data file has changed since the pack was built.
+ * 
+ * @param pack_st The status of the pack.
+ * @return int 1 if a data file is newer than the pack, 0 otherwise.
+ */
+int pack_is_stale(const struct stat *pack_st) {
+    struct stat st;
+
+    for (int i = 0; i < num_data_files; i++) {
+        if (!stat(data_files[i].fname, &st) && st.st_mtime > pack_st->st_mtime)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Map the data pack and check its header and sections.
+ * 
+ * @param fname The name of the pack.
+ * @param buf Set to the mapped pack, with its read position at the first
+ section.
+ * @param counts Set to how many actors and components the pack holds.
+ * @return int 0 if the pack was mapped, 1 if it cannot be used.
+ */
+int map_data_pack(const char *fname, struct save_buf *buf, unsigned long *counts) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) || st.st_size < PACK_HEADER_SIZE) {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 1;
+    *buf = (struct save_buf) { 0 };
+    buf->data = map;
+    buf->len = st.st_size;
+
+    if (memcmp(buf->data, pack_magic, sizeof(pack_magic))
+        || (buf->data[4] | (buf->data[5] << 8)) != PACK_VERSION
+        || (buf->data[6] | (buf->data[7] << 8)) != SAVE_VERSION) {
+        munmap(map, st.st_size);
+        return 1;
+    }
+    for (int i = 0; i < POOL_MAX; i++) {
+        counts[i] = 0;
+        for (int j = 0; j < 4; j++)
+            counts[i] |= (unsigned long) buf->data[8 + i * 4 + j] << (j * 8);
+        if (counts[i] > buf->len) {
+            munmap(map, st.st_size);
+            return 1;
+        }
+    }
+    buf->pos = PACK_HEADER_SIZE;
+    if (check_pack_sections(buf)) {
+        munmap(map, st.st_size);
+        return 1;
+    }
+    buf->pos = PACK_HEADER_SIZE;
+    return 0;
+}
+
+/**
+ * @brief Load the data pack. Nothing in the game is touched unless the whole
+ pack can be used.
+ * 
+ * @param fname The name of the pack.
+ * @return int 0 if the pack was loaded, 1 if the JSON must be read instead.
+ */
+int load_data_pack(const char *fname) {
+    struct save_buf buf;
+    unsigned long counts[POOL_MAX];
+    char name[256];
+    struct stat st;
+    size_t len;
+    int start, shuffle;
+
+    if (stat(fname, &st))
+        return 1;
+    if (pack_is_stale(&st)) {
+        logm_warning("The data pack is older than the data files. Reading the data files instead.");
+        return 1;
+    }
+    if (map_data_pack(fname, &buf, counts))
+        return 1;
+
+    pool_reserve(counts);
+    wfc_images = calloc(num_data_files, sizeof(struct wfc_image));
+    for (int i = 0; i < num_data_files; i++) {
+        get_str(&buf, name, sizeof(name));
+        get_uvar(&buf);
+        switch (data_files[i].kind) {
+            case DATA_MONSTERS:
+                start = g.total_monsters;
+                shuffle = decode_actor_section(&buf, &g.total_monsters, g.monsters);
+                shuffle_section(DATA_MONSTERS, start, g.total_monsters, shuffle);
+                break;
+            case DATA_ITEMS:
+                start = g.total_items;
+                shuffle = decode_actor_section(&buf, &g.total_items, g.items);
+                shuffle_section(DATA_ITEMS, start, g.total_items, shuffle);
+                break;
+            case DATA_WFC:
+                wfc_images[i].component_cnt = 1;
+                wfc_images[i].width = get_uvar(&buf);
+                wfc_images[i].height = get_uvar(&buf);
+                wfc_images[i].data = (unsigned char *) buf.data + buf.pos;
+                len = (size_t) wfc_images[i].width * wfc_images[i].height;
+                if (len > buf.len - buf.pos)
+                    buf.error = 1;
+                else
+                    buf.pos += len;
+                break;
+        }
+        if (buf.error)
+            panik("The data pack %s is corrupted.\n", fname);
+    }
+    return 0;
+}
+
+/**
+ * @brief Check that the pack holds a section for each data file, in order.
+ * 
+ * @param buf The pack, with its read position at the first section.
+ * @return int 0 if the sections match, 1 otherwise.
+ */
+int check_pack_sections(struct save_buf *buf) {
+    char name[256];
+    unsigned long len;
+
+    for (int i = 0; i < num_data_files; i++) {
+        get_str(buf, name, sizeof(name));
+        len = get_uvar(buf);
+        if (buf->error || strcmp(name, data_files[i].fname) || len > buf->len - buf->pos)
+            return 1;
+        buf->pos += len;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read a section of actors from the pack into an actor array.
+ * 
+ * @param buf The pack, with its read position at the section's contents.
+ * @param total_actors pointer to the count of total actors
+ * @param actor_array pointer to the array to be written to
+ * @return int The SHUFFLE_* flags of the section.
+ */
+int decode_actor_section(struct save_buf *buf, int *total_actors, struct actor **actor_array) {
+    int shuffle = get_uvar(buf);
+    unsigned long count = get_uvar(buf);
+
+    for (unsigned long i = 0; i < count && !buf->error; i++) {
+        if (*total_actors >= MAX_ACTORS)
+            panik("MAX_ACTORS exceeded while reading the data pack.\n");
+        actor_array[*total_actors] = decode_actor(buf);
+        actor_array[*total_actors]->id = *total_actors;
+        (*total_actors)++;
+    }
+    return shuffle;
+}
+
+/**
+ * @brief Shuffle the actors read from a data file, as the file asked.
+ * 
+ * @param kind DATA_MONSTERS or DATA_ITEMS.
+ * @param start The first actor read from the file.
+ * @param end One past the last actor read from the file.
+ * @param shuffle The SHUFFLE_* flags of the file.
+ */
+void shuffle_section(int kind, int start, int end, int shuffle) {
+    if (shuffle)
+        shuffle_attributes(kind == DATA_MONSTERS ? g.monsters : g.items, start, end,
+                           shuffle & SHUFFLE_APPEARANCE, shuffle & SHUFFLE_COLOR);
+}
+
+/**
+ * @brief Attach the data image. Nothing in the game is touched unless the
+ whole image can be used.
+ * 
+ * @param fname The name of the image.
+ * @return int 0 if the image was loaded, 1 if the pack must be read instead.
+ */
+int load_data_image(const char *fname) {
+    struct data_image header;
+    struct data_image *image;
+    struct image_section *section;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+        || !image_is_usable(&st, &header)) {
+        close(fd);
+        return 1;
+    }
+    /* The image is mapped privately rather than read-only, since a game
+       still writes to its prototypes as they are shuffled and identified.
+       Only the pages written to are copied. */
+    map = mmap((void *) header.base, header.size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 1;
+    if ((uintptr_t) map != header.base) {
+        munmap(map, header.size);
+        return 1;
+    }
+    image = map;
+
+    wfc_images = calloc(num_data_files, sizeof(struct wfc_image));
+    wfc_rules = calloc(num_data_files, sizeof(struct wfc_rules *));
+    if (wfc_images == NULL || wfc_rules == NULL)
+        panik("Ran out of memory while loading the data image.\n");
+    for (int i = 0; i < num_data_files; i++) {
+        section = &image->sections[i];
+        if (strcmp(section->fname, data_files[i].fname))
+            panik("The data image %s does not match the data files.\n", fname);
+        switch (data_files[i].kind) {
+            case DATA_MONSTERS:
+                for (int j = section->start; j < section->end; j++)
+                    g.monsters[g.total_monsters++] = image->monsters[j];
+                break;
+            case DATA_ITEMS:
+                for (int j = section->start; j < section->end; j++)
+                    g.items[g.total_items++] = image->items[j];
+                break;
+            case DATA_WFC:
+                wfc_images[i] = section->wfc_image;
+                wfc_rules[i] = section->wfc_rules;
+                break;
+        }
+        /* The game's arrays start out empty, so they line up with the
+           image's. */
+        shuffle_section(data_files[i].kind, section->start, section->end, section->shuffle);
+    }
+    return 0;
+}
+
+/**
+ * @brief Check that a data image was built for this version of the game,
+ from the current data files, and for the data files the game loads.
+ * 
+ * @param st The status of the image.
+ * @param header The header of the image.
+ * @return int 1 if the image can be used, 0 otherwise.
+ */
+int image_is_usable(const struct stat *st, const struct data_image *header) {
+    struct stat pack_st;
+
+    if (memcmp(header->magic, image_magic, sizeof(image_magic))
+        || header->version != IMAGE_VERSION
+        || header->save_version != SAVE_VERSION
+        || header->size != (size_t) st->st_size
+        || memcmp(header->layout, image_layout, sizeof(image_layout))
+        || header->num_sections != num_data_files)
+        return 0;
+    if (pack_is_stale(st) || (!stat(DATA_PACK, &pack_st) && pack_st.st_mtime > st->st_mtime)) {
+        logm_warning("The data image is older than the data files. Reading the data files instead.");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Get a wfc image, from the data pack if it was loaded and from the
+ JSON otherwise.
+ * 
+ * @param fname The data file the image comes from.
+ * @return struct wfc_image The image. Its data must be freed by the caller.
+ */
+struct wfc_image load_wfc_image(const char *fname) {
+    struct wfc_image image;
+    size_t len;
+
+    for (int i = 0; wfc_images != NULL && i < num_data_files; i++) {
+        if (wfc_images[i].data == NULL || strcmp(data_files[i].fname, fname))
+            continue;
+        image = wfc_images[i];
+        len = (size_t) image.width * image.height;
+        image.data = malloc(len + 1);
+        memcpy(image.data, wfc_images[i].data, len);
+        image.data[len] = '\0';
+        return image;
+    }
+    image = parse_wfc_json(fname);
+    if (!image.width)
+        logm_warning("Error: Could not read wfc image %s.", fname);
+    return image;
+}
+
+/**
+ * @brief Get the compiled wfc rules for a data file, compiling them if the
+ data image did not hold them.
+ * 
+ * @param fname The data file the rules come from.
+ * @return const struct wfc_rules* The rules, or NULL if they could not be
+ compiled.
+ */
+const struct wfc_rules *load_wfc_rules(const char *fname) {
+    struct wfc_image image;
+    int i;
+
+    for (i = 0; i < num_data_files; i++) {
+        if (data_files[i].kind == DATA_WFC && !strcmp(data_files[i].fname, fname))
+            break;
+    }
+    if (i == num_data_files) {
+        logm_warning("Error: %s is not a wfc data file.", fname);
+        return NULL;
+    }
+    if (wfc_rules == NULL) {
+        wfc_rules = calloc(num_data_files, sizeof(struct wfc_rules *));
+        if (wfc_rules == NULL)
+            panik("Ran out of memory while compiling the wfc rules.\n");
+    }
+    if (wfc_rules[i] == NULL) {
+        image = load_wfc_image(fname);
+        if (image.width && image.height)
+            wfc_rules[i] = compile_wfc_rules(&image);
+        free(image.data);
+    }
+    return wfc_rules[i];
+}
+
+/**
+ * @brief Build the data pack from the data files. Used by the data compiler
+ at build time rather than by the game. Parses every data file into g.monsters
+ and g.items without shuffling them, and writes them out with the save's actor
+ records.
+ * 
+ * @param fname The name of the pack to write.
+ * @return int 0 on success, 1 on failure.
+ */
+int compile_data_pack(const char *fname) {
+    unsigned char header[PACK_HEADER_SIZE];
+    unsigned long counts[POOL_MAX] = { 0 };
+    struct save_buf out = { 0 };
+    struct save_buf body = { 0 };
+    struct save_buf section;
+    struct wfc_image image;
+    struct actor **actor_array;
+    int *total_actors;
+    int start, shuffle, ret;
+
+    for (int i = 0; i < num_data_files; i++) {
+        section = (struct save_buf) { 0 };
+        if (data_files[i].kind == DATA_WFC) {
+            image = parse_wfc_json(data_files[i].fname);
+            if (!image.width || !image.height) {
+                fprintf(stderr, "Could not read wfc image %s.\n", data_files[i].fname);
+                free(image.data);
+                return 1;
+            }
+            put_uvar(&section, image.width);
+            put_uvar(&section, image.height);
+            put_bytes(&section, image.data, (size_t) image.width * image.height);
+            free(image.data);
+        } else {
+            actor_array = data_files[i].kind == DATA_MONSTERS ? g.monsters : g.items;
+            total_actors = data_files[i].kind == DATA_MONSTERS ? &g.total_monsters : &g.total_items;
+            start = *total_actors;
+            shuffle = parse_actor_file(data_files[i].fname, total_actors, actor_array);
+            if (shuffle < 0) {
+                fprintf(stderr, "Could not read data file %s.\n", data_files[i].fname);
+                return 1;
+            }
+            put_uvar(&section, shuffle);
+            put_uvar(&section, *total_actors - start);
+            for (int j = start; j < *total_actors; j++) {
+                count_actor(actor_array[j], counts);
+                encode_actor(&section, actor_array[j]);
+            }
+        }
+        put_str(&body, data_files[i].fname);
+        put_uvar(&body, section.len);
+        put_bytes(&body, section.data, section.len);
+        free(section.data);
+    }
+
+    memcpy(header, pack_magic, sizeof(pack_magic));
+    header[4] = PACK_VERSION & 0xff;
+    header[5] = (PACK_VERSION >> 8) & 0xff;
+    header[6] = SAVE_VERSION & 0xff;
+    header[7] = (SAVE_VERSION >> 8) & 0xff;
+    for (int i = 0; i < POOL_MAX; i++) {
+        for (int j = 0; j < 4; j++)
+            header[8 + i * 4 + j] = (counts[i] >> (j * 8)) & 0xff;
+    }
+    put_bytes(&out, header, PACK_HEADER_SIZE);
+    put_bytes(&out, body.data, body.len);
+    ret = write_save_file(fname, &out);
+    if (ret)
+        fprintf(stderr, "Could not write data pack %s.\n", fname);
+    free(body.data);
+    free(out.data);
+    return ret;
+}
+
+/**
+ * @brief Build the data image from the data pack. Used by the data compiler
+ at build time rather than by the game.
+ * 
+ * @param fname The name of the image to write.
+ * @param pack_fname The name of the pack to build it from.
+ * @return int 0 on success, 1 on failure.
+ */
+int compile_data_image(const char *fname, const char *pack_fname) {
+    unsigned long counts[POOL_MAX];
+    struct wfc_rules **rules;
+    struct save_buf pack;
+    size_t size;
+    int ret;
+
+    if (map_data_pack(pack_fname, &pack, counts)) {
+        fprintf(stderr, "Could not read data pack %s.\n", pack_fname);
+        return 1;
+    }
+    rules = calloc(num_data_files, sizeof(struct wfc_rules *));
+    if (rules == NULL)
+        panik("Ran out of memory while building the data image.\n");
+    size = data_image_size(&pack, counts, rules);
+    ret = !size || write_data_image(fname, &pack, counts, rules, size);
+    for (int i = 0; i < num_data_files; i++)
+        wfc_rules_destroy(rules[i]);
+    free(rules);
+    munmap(pack.data, pack.len);
+    return ret;
+}
+
+/**
+ * @brief Compile the wfc rules of every wfc section of the pack, and work
+ out how large the image holding everything will be.
+ * 
+ * @param pack The pack, with its read position at the first section.
+ * @param counts How many actors and components the pack holds.
+ * @param rules Filled with the rules, by data file.
+ * @return size_t The size of the image, or 0 if some rules could not be
+ compiled.
+ */
+size_t data_image_size(struct save_buf *pack, const unsigned long *counts, struct wfc_rules **rules) {
+    struct wfc_image image;
+    char name[256];
+    size_t size, len;
+
+    size = IMAGE_ALIGN(sizeof(struct data_image))
+         + IMAGE_ALIGN(sizeof(struct image_section) * num_data_files)
+         + pool_size(counts, NULL);
+    for (int i = 0; i < num_data_files; i++) {
+        get_str(pack, name, sizeof(name));
+        len = get_uvar(pack);
+        if (data_files[i].kind != DATA_WFC) {
+            pack->pos += len;
+            continue;
+        }
+        image.component_cnt = 1;
+        image.width = get_uvar(pack);
+        image.height = get_uvar(pack);
+        image.data = pack->data + pack->pos;
+        len = (size_t) image.width * image.height;
+        if (pack->error || len > pack->len - pack->pos)
+            return 0;
+        rules[i] = compile_wfc_rules(&image);
+        if (rules[i] == NULL) {
+            fprintf(stderr, "Could not compile the wfc rules for %s.\n", name);
+            return 0;
+        }
+        size += IMAGE_ALIGN(len) + IMAGE_ALIGN(wfc_rules_size(rules[i]));
+        pack->pos += len;
+    }
+    return size;
+}
+
+/**
+ * @brief Write the data image. The actors are decoded and the wfc rules
+ copied straight into a block mapped where the game will map the image, and
+ the block is then written out as it is.
+ * 
+ * @param fname The name of the image to write.
+ * @param pack The pack.
+ * @param counts How many actors and components the pack holds.
+ * @param rules The compiled rules, by data file.
+ * @param size The size of the image.
+ * @return int 0 on success, 1 on failure.
+ */
+int write_data_image(const char *fname, struct save_buf *pack, const unsigned long *counts,
+                     struct wfc_rules **rules, size_t size) {
+    struct save_buf out = { 0 };
+    struct data_image *image;
+    struct image_section *section;
+    unsigned char *map, *next;
+    char name[256];
+    size_t len;
+    int ret;
+
+    map = mmap((void *) IMAGE_BASE, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (map == MAP_FAILED || (uintptr_t) map != IMAGE_BASE) {
+        fprintf(stderr, "Could not map the data image at its address.\n");
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        return 1;
+    }
+    image = (struct data_image *) map;
+    memcpy(image->magic, image_magic, sizeof(image_magic));
+    image->version = IMAGE_VERSION;
+    image->save_version = SAVE_VERSION;
+    image->base = IMAGE_BASE;
+    image->size = size;
+    memcpy(image->layout, image_layout, sizeof(image_layout));
+    image->num_sections = num_data_files;
+    next = map + IMAGE_ALIGN(sizeof(struct data_image));
+    image->sections = (struct image_section *) next;
+    next += IMAGE_ALIGN(sizeof(struct image_section) * num_data_files);
+    pool_place(next, counts);
+    next += pool_size(counts, NULL);
+
+    pack->pos = PACK_HEADER_SIZE;
+    for (int i = 0; i < num_data_files; i++) {
+        section = &image->sections[i];
+        get_str(pack, name, sizeof(name));
+        get_uvar(pack);
+        snprintf(section->fname, sizeof(section->fname), "%s", data_files[i].fname);
+        switch (data_files[i].kind) {
+            case DATA_MONSTERS:
+                section->start = image->total_monsters;
+                section->shuffle = decode_actor_section(pack, &image->total_monsters, image->monsters);
+                section->end = image->total_monsters;
+                break;
+            case DATA_ITEMS:
+                section->start = image->total_items;
+                section->shuffle = decode_actor_section(pack, &image->total_items, image->items);
+                section->end = image->total_items;
+                break;
+            case DATA_WFC:
+                section->wfc_image.component_cnt = 1;
+                section->wfc_image.width = get_uvar(pack);
+                section->wfc_image.height = get_uvar(pack);
+                section->wfc_image.data = next;
+                len = (size_t) section->wfc_image.width * section->wfc_image.height;
+                memcpy(next, pack->data + pack->pos, len);
+                pack->pos += len;
+                next += IMAGE_ALIGN(len);
+                section->wfc_rules = wfc_rules_copy(rules[i], next);
+                next += IMAGE_ALIGN(wfc_rules_size(rules[i]));
+                break;
+        }
+    }
+    /* The pool was only lent the image. */
+    free_actor_pool();
+
+    out.data = map;
+    out.len = size;
+    ret = pack->error || write_save_file(fname, &out);
+    if (ret)
+        fprintf(stderr, "Could not write data image %s.\n", fname);
+    munmap(map, size);
+    return ret;
+}
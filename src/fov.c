@@ -128,8 +128,10 @@ void calculate_fov(int x, int y, int range) {
 void clear_fov(void) {
     for (int y = 0; y < MAPH; y++) {
         for (int x = 0; x < MAPW; x++) {
-            g.levmap[x][y].visible = 0;
-            mark_refresh(x, y);
+            if (g.levmap[x][y].visible) {
+                g.levmap[x][y].visible = 0;
+                mark_refresh(x, y);
+            }
         }
     }
 }
\ No newline at end of file
@@ -17,6 +17,8 @@
 #include "message.h"
 #include "windows.h"
 #include "gameover.h"
+#include "save.h"
+#include "journal.h"
 
 int write_dumplog(const char *, int);
 void dump_target(FILE *);
@@ -48,6 +50,10 @@ int do_quit(void) {
  0 if the game was lost.
  */
 void end_game(int winner) {
+    /* A journal replayed on its own ends here, without touching any files. */
+    if (journal_replay_only())
+        exit(0);
+    delete_save();
     if (!write_dumplog("dumplog.txt", winner)
         && yn_prompt("View the game summary?", 1)) {
         display_file_text("dumplog.txt");
@@ -0,0 +1,688 @@
+/**
+ * @file journal.c
+ * @brief An append-only journal of the actions the player has taken since
+ the last save. Every action the player executes appends a record holding the
+ action, how many random numbers had been drawn when it began, and every key
+ the player pressed since the previous record. Keys read outside of the
+ player's actions, such as answers to prompts during other actors' turns, get
+ a record of their own before the player's next action. If the game dies
+ between saves, the journal is replayed on top of the last save to bring the
+ game back to where it was. A journal that reaches back to the start of a game
+ can also be replayed on its own, as fast as possible and without a display,
+ for regression testing and profiling.
+ * @version 1.0
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "register.h"
+#include "journal.h"
+#include "action.h"
+#include "mapgen.h"
+#include "message.h"
+#include "random.h"
+#include "save.h"
+#include "render.h"
+#include "windows.h"
+
+struct journal_rec {
+    unsigned long seq;
+    int turn;
+    int action; /* -1 for a record that only holds keys. */
+    unsigned long draws;
+    size_t key_start; /* Index of the record's first key in the replay keys. */
+};
+
+void journal_filename(char *, size_t);
+void add_key(int **, size_t *, size_t *, int);
+void write_record(int);
+int decode_record(struct save_buf *, struct journal_rec *, int);
+int read_journal(const char *, struct save_buf *);
+void scan_journal(struct save_buf *, struct save_buf *, unsigned long, unsigned long, unsigned long);
+void rewrite_journal(unsigned long, unsigned long, unsigned long);
+void put_journal_header(struct save_buf *);
+void skip_key_records(void);
+void finish_replay(void);
+int journal_handle_keys(void);
+void journal_text_entry(const char *, char *, int);
+signed char journal_menu_do_choice(struct menu *, int);
+void journal_display_file_text(const char *);
+void journal_draw_msg_window(int);
+
+/* Journal file layout. A header, followed by records that are each prefixed
+   with their length, so that a record torn by a crash can be detected and
+   dropped. The header holds the magic, version and game mode flags, which
+   include how levels are generated, followed by the seed and team name the
+   game was started with. */
+static const unsigned char journal_magic[4] = { 'Z', 'Z', 'J', 'L' };
+#define JOURNAL_VERSION 2
+#define JOURNAL_HEADER_SIZE 8
+
+static FILE *journal_fp = NULL;
+static unsigned long next_seq = 0;
+static int depth = 0;                   /* Nesting of execute_action(). */
+static unsigned long action_draws = 0;  /* Draws when the action began. */
+
+/* Keys read since the last record was written. */
+static int *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+
+/* Records being replayed, and the keys they read. */
+static struct journal_rec *recs = NULL;
+static size_t rec_count = 0;
+static size_t rec_cap = 0;
+static size_t rec_pos = 0;
+static int *keys = NULL;
+static size_t key_count = 0;
+static size_t key_cap = 0;
+static size_t key_pos = 0;
+static unsigned long replay_end = 0; /* One past the last replayed record. */
+static int replaying = 0;
+
+/* Set when replaying a journal on its own with --replay, rather than
+   recovering a game. */
+static int replay_only = 0;
+static size_t replay_total = 0;
+static struct timespec replay_start;
+
+/* Whether records covered by a save are kept, so that the journal always
+   reaches back to the start of the game. */
+static int keep_all = 0;
+
+/* The windowport that the journal sits in front of. */
+static struct window_procs real_procs;
+
+/**
+ * @brief Build the name of the journal file for the current team.
+ * 
+ * @param fname The buffer to write the name to.
+ * @param size The size of the buffer.
+ */
+void journal_filename(char *fname, size_t size) {
+    snprintf(fname, size, "%s.jnl", g.userbuf);
+}
+
+/**
+ * @brief Append a key to a growable array of keys.
+ * 
+ * @param arr The array.
+ * @param len The number of keys in the array.
+ * @param cap The capacity of the array.
+ * @param key The key to append.
+ */
+void add_key(int **arr, size_t *len, size_t *cap, int key) {
+    if (*len == *cap) {
+        *cap = max(*cap * 2, 64);
+        *arr = realloc(*arr, *cap * sizeof(int));
+        if (*arr == NULL)
+            panik("Ran out of memory while journaling.");
+    }
+    (*arr)[(*len)++] = key;
+}
+
+/**
+ * @brief Open the journal and start recording. Takes over the input
+ functions of the windowport, so that every key the player presses can be
+ recorded and, when replaying, fed back in.
+ * 
+ * @param resume Whether the game was just loaded from a save. If so, any
+ records made after the save are replayed. Otherwise the journal starts out
+ empty.
+ */
+void journal_open(int resume) {
+    real_procs = windowprocs;
+    windowprocs.win_handle_keys = journal_handle_keys;
+    windowprocs.win_text_entry = journal_text_entry;
+    windowprocs.win_menu_do_choice = journal_menu_do_choice;
+    windowprocs.win_display_file_text = journal_display_file_text;
+    windowprocs.win_draw_msg_window = journal_draw_msg_window;
+
+    if (resume) {
+        rewrite_journal(keep_all ? 0 : next_seq, ULONG_MAX, next_seq);
+    } else {
+        rewrite_journal(ULONG_MAX, ULONG_MAX, ULONG_MAX);
+    }
+    if (rec_count) {
+        /* Replay without drawing anything, and without stopping for any
+           of the screens that wait for a keypress. */
+        replaying = 1;
+        windowprocs.has_display = 0;
+    }
+}
+
+/**
+ * @brief Set up a replay of a journal on its own. The journal must reach back
+ to the start of a game. Restores the seed, team, game mode and level
+ generator that the game was started with, and takes over the windowport like
+ journal_open(), but nothing is ever written. Must be called before the game is
+ set up. Once the records run out, or the game stops matching them, the
+ program exits.
+ * 
+ * @param fname The name of the journal to replay.
+ */
+void journal_replay_file(const char *fname) {
+    struct save_buf in = { 0 };
+    unsigned int flags;
+
+    if (read_journal(fname, &in)) {
+        fprintf(stderr, "Could not read journal %s.\n", fname);
+        exit(1);
+    }
+    flags = in.data[6] | (in.data[7] << 8);
+    g.debug = flags & 1;
+    g.practice = (flags >> 1) & 1;
+    set_mapgen((flags >> 2) & 3);
+    rndseed(get_uvar(&in));
+    get_str(&in, g.userbuf, sizeof(g.userbuf));
+    scan_journal(&in, NULL, 0, ULONG_MAX, 0);
+    free(in.data);
+    if (!rec_count) {
+        fprintf(stderr, "Journal %s does not reach back to the start of a game.\n", fname);
+        exit(1);
+    }
+
+    real_procs = windowprocs;
+    windowprocs.win_handle_keys = journal_handle_keys;
+    windowprocs.win_text_entry = journal_text_entry;
+    windowprocs.win_menu_do_choice = journal_menu_do_choice;
+    windowprocs.win_display_file_text = journal_display_file_text;
+    windowprocs.win_draw_msg_window = journal_draw_msg_window;
+    windowprocs.has_display = 0;
+    replaying = 1;
+    replay_only = 1;
+    replay_total = rec_count;
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+}
+
+/**
+ * @brief Report on a replay started with journal_replay_file(): how far it
+ got, how fast it ran, and a checksum of the final state of the game, taken
+ over its serialized form. Does nothing otherwise.
+ * 
+ */
+void journal_report(void) {
+    struct save_buf buf = { 0 };
+    struct timespec now;
+    unsigned long long hash = 14695981039346656037ULL;
+    double elapsed;
+
+    if (!replay_only)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - replay_start.tv_sec) + (now.tv_nsec - replay_start.tv_nsec) / 1e9;
+    /* FNV-1a. */
+    encode_game(&buf);
+    for (size_t i = 0; i < buf.len; i++) {
+        hash ^= buf.data[i];
+        hash *= 1099511628211ULL;
+    }
+    free(buf.data);
+    printf("Replayed %lu of %lu actions over %d turns in %.3f seconds (%.0f turns/sec).\n",
+           next_seq, (unsigned long) replay_total, g.turns, elapsed,
+           elapsed > 0 ? g.turns / elapsed : 0.0);
+    printf("Final state checksum: %016llx\n", hash);
+}
+
+/**
+ * @brief Set whether records covered by a save are kept. Keeping them lets a
+ whole game be replayed with journal_replay_file(), at the cost of a journal
+ that grows for as long as the game goes on.
+ * 
+ * @param keep Whether to keep every record.
+ */
+void journal_set_keep(int keep) {
+    keep_all = keep;
+}
+
+/**
+ * @brief Close the journal.
+ * 
+ */
+void journal_close(void) {
+    if (journal_fp != NULL)
+        fclose(journal_fp);
+    journal_fp = NULL;
+}
+
+/**
+ * @brief Close and delete the journal. Called once the game is over.
+ * 
+ */
+void journal_delete(void) {
+    char fname[MAX_USERSZ + 4];
+
+    journal_close();
+    journal_filename(fname, sizeof(fname));
+    remove(fname);
+}
+
+/**
+ * @brief Called when the player starts executing an action. While replaying,
+ checks that the game is still doing what it did the first time around.
+ * 
+ * @param action The action being executed.
+ */
+void journal_begin(struct action *action) {
+    struct journal_rec *rec;
+
+    /* Only the outermost action gets a record. */
+    if (depth++)
+        return;
+    if (replaying) {
+        skip_key_records();
+        rec = &recs[rec_pos];
+        if (rec_pos == rec_count || rec->draws != rnd_draws() || rec->action != action->index)
+            finish_replay();
+    }
+    action_draws = rnd_draws();
+}
+
+/**
+ * @brief Called when the player finishes executing an action. Appends the
+ action to the journal.
+ * 
+ * @param action The action that was executed.
+ */
+void journal_end(struct action *action) {
+    if (--depth)
+        return;
+    if (replaying) {
+        next_seq = recs[rec_pos++].seq + 1;
+        skip_key_records();
+        if (rec_pos == rec_count)
+            finish_replay();
+        return;
+    }
+    write_record(action->index);
+}
+
+/**
+ * @brief Write out the keys read since the player's last action, if there
+ are any. Called at the start of each of the player's actions, so that the
+ keys belonging to an action are the only ones pending while it runs, and a
+ save made at that point covers every key that came before.
+ * 
+ */
+void journal_flush(void) {
+    if (pending_len && !replaying)
+        write_record(-1);
+}
+
+/**
+ * @brief Append a record to the journal, then flush it so that it survives
+ the process dying.
+ * 
+ * @param index The index of the action being recorded, or -1 if the record
+ only holds keys.
+ */
+void write_record(int index) {
+    struct save_buf rec = { 0 };
+    struct save_buf out = { 0 };
+    struct coord dir = { 0, 0 };
+
+    if (journal_fp != NULL) {
+        if (index >= 0 && actions[index].movement)
+            dir = action_to_dir(&actions[index]);
+        put_uvar(&rec, next_seq);
+        put_svar(&rec, g.turns);
+        put_svar(&rec, index);
+        put_svar(&rec, dir.x);
+        put_svar(&rec, dir.y);
+        put_uvar(&rec, action_draws);
+        put_uvar(&rec, pending_len);
+        for (size_t i = 0; i < pending_len; i++)
+            put_svar(&rec, pending[i]);
+        put_uvar(&out, rec.len);
+        put_bytes(&out, rec.data, rec.len);
+        if (fwrite(out.data, 1, out.len, journal_fp) != out.len || fflush(journal_fp)) {
+            logm_warning("Could not write to the journal. Journaling stopped.");
+            journal_close();
+        }
+        free(rec.data);
+        free(out.data);
+    }
+    pending_len = 0;
+    next_seq++;
+}
+
+/**
+ * @brief Read a record.
+ * 
+ * @param buf A buffer holding exactly the record.
+ * @param rec Where to store the record.
+ * @param queue Whether to add the record's keys to the replay keys.
+ * @return int 0 on success, 1 if the record is damaged.
+ */
+int decode_record(struct save_buf *buf, struct journal_rec *rec, int queue) {
+    unsigned long nkeys;
+
+    rec->seq = get_uvar(buf);
+    rec->turn = get_svar(buf);
+    rec->action = get_svar(buf);
+    get_svar(buf); /* Direction. Implied by the action and kept for tools. */
+    get_svar(buf);
+    rec->draws = get_uvar(buf);
+    rec->key_start = key_count;
+    nkeys = get_uvar(buf);
+    if (nkeys > buf->len)
+        return 1;
+    for (unsigned long i = 0; i < nkeys; i++) {
+        int key = get_svar(buf);
+        if (queue)
+            add_key(&keys, &key_count, &key_cap, key);
+    }
+    if (buf->error) {
+        key_count = rec->key_start;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read a journal file into a buffer and check its header.
+ * 
+ * @param fname The name of the journal.
+ * @param in The buffer to read into. Should be zero-initialized, and must be
+ freed by the caller. On success, its read position is left just past the
+ fixed part of the header.
+ * @return int 0 if the journal was read, 1 if it is missing or not a journal
+ of this version.
+ */
+int read_journal(const char *fname, struct save_buf *in) {
+    FILE *fp;
+    long size;
+
+    fp = fopen(fname, "rb");
+    if (fp == NULL)
+        return 1;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size > 0) {
+        in->data = malloc(size);
+        in->len = fread(in->data, 1, size, fp);
+    }
+    fclose(fp);
+
+    if (in->len < JOURNAL_HEADER_SIZE || memcmp(in->data, journal_magic, sizeof(journal_magic))
+        || (in->data[4] | (in->data[5] << 8)) != JOURNAL_VERSION)
+        return 1;
+    in->pos = JOURNAL_HEADER_SIZE;
+    return 0;
+}
+
+/**
+ * @brief Write the header of a journal for the game being played.
+ * 
+ * @param out The buffer to write to.
+ */
+void put_journal_header(struct save_buf *out) {
+    unsigned char header[JOURNAL_HEADER_SIZE] = { 0 };
+    unsigned int flags = g.debug | (g.practice << 1) | (get_mapgen() << 2);
+
+    memcpy(header, journal_magic, sizeof(journal_magic));
+    header[4] = JOURNAL_VERSION & 0xff;
+    header[5] = (JOURNAL_VERSION >> 8) & 0xff;
+    header[6] = flags & 0xff;
+    header[7] = (flags >> 8) & 0xff;
+    put_bytes(out, header, JOURNAL_HEADER_SIZE);
+    put_uvar(out, rnd_seed());
+    put_str(out, g.userbuf);
+}
+
+/**
+ * @brief Walk the records of a journal, copying and queueing the ones in
+ given ranges of sequence numbers. Damaged records, and anything after them,
+ are dropped.
+ * 
+ * @param in The journal, with its read position at the first record.
+ * @param out The buffer to copy kept records to, or NULL.
+ * @param min_seq The first sequence number to keep.
+ * @param max_seq One past the last sequence number to keep.
+ * @param queue_seq The first sequence number to queue for replay, or
+ ULONG_MAX to queue nothing. Queued records must follow on from it without a
+ gap.
+ */
+void scan_journal(struct save_buf *in, struct save_buf *out, unsigned long min_seq,
+                  unsigned long max_seq, unsigned long queue_seq) {
+    struct save_buf payload;
+    struct journal_rec rec;
+    size_t start, len;
+
+    while (in->pos < in->len) {
+        start = in->pos;
+        len = get_uvar(in);
+        if (in->error || len > in->len - in->pos)
+            break;
+        payload = (struct save_buf) { in->data + in->pos, len, len, 0, 0 };
+        in->pos += len;
+        if (decode_record(&payload, &rec, 0))
+            break;
+        if (rec.seq >= queue_seq && rec.seq == queue_seq + rec_count) {
+            payload.pos = 0;
+            decode_record(&payload, &rec, 1);
+            if (rec_count == rec_cap) {
+                rec_cap = max(rec_cap * 2, 64);
+                recs = realloc(recs, rec_cap * sizeof(struct journal_rec));
+                if (recs == NULL)
+                    panik("Ran out of memory while reading the journal.");
+            }
+            recs[rec_count++] = rec;
+            replay_end = rec.seq + 1;
+        }
+        if (out != NULL && rec.seq >= min_seq && rec.seq < max_seq)
+            put_bytes(out, in->data + start, in->pos - start);
+    }
+}
+
+/**
+ * @brief Rewrite the journal file, keeping only the records in a given range
+ of sequence numbers.
+ * 
+ * @param min_seq The first sequence number to keep.
+ * @param max_seq One past the last sequence number to keep.
+ * @param queue_seq The first sequence number to queue for replay, or
+ ULONG_MAX to queue nothing. Queued records must pick up exactly where the
+ last save left off.
+ */
+void rewrite_journal(unsigned long min_seq, unsigned long max_seq, unsigned long queue_seq) {
+    char fname[MAX_USERSZ + 4];
+    char team[MAX_USERSZ];
+    struct save_buf in = { 0 };
+    struct save_buf out = { 0 };
+
+    journal_filename(fname, sizeof(fname));
+    journal_close();
+    put_journal_header(&out);
+    if (!read_journal(fname, &in)) {
+        /* Skip the rest of the old header. */
+        get_uvar(&in);
+        get_str(&in, team, sizeof(team));
+        if (!in.error)
+            scan_journal(&in, &out, min_seq, max_seq, queue_seq);
+    }
+
+    if (write_save_file(fname, &out))
+        logm_warning("Could not write journal %s.", fname);
+    journal_fp = fopen(fname, "ab");
+    if (journal_fp == NULL)
+        logm_warning("Could not open journal %s. Journaling stopped.", fname);
+    free(in.data);
+    free(out.data);
+}
+
+/**
+ * @brief Drop every record that a save has made redundant. Called once a
+ save has safely made it to disk.
+ * 
+ * @param seq The sequence number of the first action the save does not
+ include.
+ */
+void journal_compact(unsigned long seq) {
+    if (journal_fp == NULL || keep_all)
+        return;
+    rewrite_journal(seq, ULONG_MAX, ULONG_MAX);
+}
+
+unsigned long journal_seq(void) {
+    return next_seq;
+}
+
+void journal_set_seq(unsigned long seq) {
+    next_seq = seq;
+}
+
+int journal_replaying(void) {
+    return replaying;
+}
+
+int journal_replay_only(void) {
+    return replay_only;
+}
+
+/**
+ * @brief Step past any records that only hold keys once all of their keys
+ have been read.
+ * 
+ */
+void skip_key_records(void) {
+    size_t key_end;
+
+    while (rec_pos < rec_count && recs[rec_pos].action < 0) {
+        key_end = rec_pos + 1 < rec_count ? recs[rec_pos + 1].key_start : key_count;
+        if (key_pos < key_end)
+            return;
+        next_seq = recs[rec_pos++].seq + 1;
+    }
+}
+
+/**
+ * @brief Stop replaying and hand control back to the player. If the game
+ stopped matching the journal before every record was replayed, the
+ remaining records are dropped.
+ * 
+ */
+void finish_replay(void) {
+    if (replay_only) {
+        if (rec_pos < rec_count)
+            fprintf(stderr, "The journal is out of sync at turn %d, record %lu.\n", g.turns, recs[rec_pos].seq);
+        exit(rec_pos < rec_count);
+    }
+    if (rec_pos < rec_count) {
+        logm_warning("The journal is out of sync at turn %d. Stopped replaying.", g.turns);
+        next_seq = recs[rec_pos].seq;
+        rewrite_journal(0, next_seq, ULONG_MAX);
+        /* Keys the current action has already read start its new record. */
+        for (size_t i = recs[rec_pos].key_start; i < key_pos; i++)
+            add_key(&pending, &pending_len, &pending_cap, keys[i]);
+    } else if (rec_pos) {
+        logm("Recovered the game up to turn %d from the journal.", g.turns);
+        next_seq = replay_end;
+    }
+    replaying = 0;
+    windowprocs.has_display = real_procs.has_display;
+    free(recs);
+    free(keys);
+    recs = NULL;
+    keys = NULL;
+    rec_count = rec_cap = rec_pos = 0;
+    key_count = key_cap = key_pos = 0;
+    f.update_map = 1;
+    f.update_msg = 1;
+}
+
+/* WINDOWPORT WRAPPERS */
+
+/**
+ * @brief Read a key, either from the windowport or, while replaying, from
+ the journal.
+ * 
+ * @return int The key read.
+ */
+int journal_handle_keys(void) {
+    int key;
+
+    if (replaying) {
+        if (key_pos < key_count)
+            return keys[key_pos++];
+        skip_key_records();
+        finish_replay();
+        /* Nothing has been drawn while replaying. */
+        render_all();
+    }
+    key = real_procs.win_handle_keys();
+    add_key(&pending, &pending_len, &pending_cap, key);
+    return key;
+}
+
+/**
+ * @brief Read a line of text. The line is journaled as the keys that make
+ it up, followed by a newline.
+ * 
+ * @param prompt What to prompt the player with.
+ * @param buf The buffer to write to.
+ * @param bufsiz The size of the buffer to write to.
+ */
+void journal_text_entry(const char *prompt, char *buf, int bufsiz) {
+    int index = 0;
+    int key;
+
+    if (replaying && key_pos < key_count) {
+        while (key_pos < key_count && (key = keys[key_pos++]) != '\n') {
+            if (index < bufsiz - 1)
+                buf[index++] = key;
+        }
+        buf[index] = '\0';
+        return;
+    } else if (replaying) {
+        skip_key_records();
+        finish_replay();
+    }
+    real_procs.win_text_entry(prompt, buf, bufsiz);
+    for (index = 0; buf[index] != '\0'; index++)
+        add_key(&pending, &pending_len, &pending_cap, buf[index]);
+    add_key(&pending, &pending_len, &pending_cap, '\n');
+}
+
+/**
+ * @brief Pick a menu item. The choice is journaled as the item's index, or
+ escape if the menu was exited.
+ * 
+ * @param menu The menu that is taking input.
+ * @param can_quit Defines whether the menu can be exited manually.
+ * @return signed char The index that was selected, or -1 if the menu was
+ exited.
+ */
+signed char journal_menu_do_choice(struct menu *menu, int can_quit) {
+    signed char choice;
+
+    if (replaying && key_pos < key_count) {
+        choice = keys[key_pos++];
+        return choice == 27 ? -1 : choice;
+    } else if (replaying) {
+        skip_key_records();
+        finish_replay();
+    }
+    choice = real_procs.win_menu_do_choice(menu, can_quit);
+    add_key(&pending, &pending_len, &pending_cap, choice < 0 ? 27 : choice);
+    return choice;
+}
+
+void journal_display_file_text(const char *fname) {
+    if (!replaying)
+        real_procs.win_display_file_text(fname);
+}
+
+void journal_draw_msg_window(int full) {
+    if (replaying) {
+        f.update_msg = 0;
+        return;
+    }
+    real_procs.win_draw_msg_window(full);
+}
@@ -30,8 +30,9 @@
 #include "action.h"
 #include "save.h"
 #include "spawn.h"
-#include "parser.h"
+#include "datapack.h"
 #include "version.h"
+#include "journal.h"
 
 void handle_exit(void);
 void handle_sigwinch(int);
@@ -45,9 +46,12 @@ error_t parse_args(int, char *, struct argp_state *);
  */
 void handle_exit(void) {
     int freed, i;
+    finish_saving();
     cleanup_screen();
+    journal_report();
     if (g.debug)
         printf("Freeing message list...\n");
+    journal_close();
     freed = free_message_list(g.msg_list);
     if (g.debug) {
         printf("Freed %d messages.\n", freed);
@@ -64,6 +68,7 @@ void handle_exit(void) {
     for (i = 0; i < g.total_items; i++) {
         free_actor(g.items[i]);
     }
+    free_actor_pool();
     if (term.saved_locale != NULL) {
         if (g.debug) printf("Restoring locale...\n");
         setlocale (LC_ALL, term.saved_locale);
@@ -112,13 +117,8 @@ void handle_sigsegv(int sig) {
  * 
  */
 void new_game(void) {
-    /* Parse creatures */
-    json_to_actor_array("data/creature/characters.json", &g.total_monsters, g.monsters);
-    json_to_actor_array("data/creature/boxers.json", &g.total_monsters, g.monsters);
-    json_to_actor_array("data/creature/employees.json", &g.total_monsters, g.monsters);
-    json_to_actor_array("data/creature/debug.json", &g.total_monsters, g.monsters);
-    /* Parse items */
-    json_to_actor_array("data/item/weapons.json", &g.total_items, g.items);
+    /* Load creatures and items */
+    load_game_data();
     if (g.practice || g.debug) {
         logm("The high score list is disabled due to the game mode.");
     }
@@ -144,6 +144,13 @@ static struct argp_option options[] = {
     { "version",  'v', 0, 0, "Display version information.", 0},
     { "debug",    'd', 0, 0, "Activates debug mode. Debug mode enables debug commands and makes losing optional. Disables the high score list.", 0},
     { "practice", 'p', 0, 0, "Activates practice mode. Practice mode makes losing optional. Disables the high score list.", 0},
+    { "fps",      'f', "FPS", 0, "Limit the frame rate while running or exploring. 0 draws only the final frame. Defaults to 30.", 0},
+    { "seed",     's', "SEED", 0, "Seed the random number generator with SEED instead of the time, making the game reproducible.", 0},
+    { "autosave", 'a', "TURNS", 0, "Autosave every TURNS turns. 0 disables autosaving. Defaults to 100.", 0},
+    { "keep-journal", 'k', 0, 0, "Keep the whole game in the journal instead of only the actions since the last save, so that it can be replayed with --replay.", 0},
+    { "replay",   'r', "FILE", 0, "Replay a journal kept with --keep-journal as fast as possible without a display, then report the turns per second and a checksum of the final state. Exits with 1 if the game stops matching the journal.", 0},
+    { "mapgen",   'm', "KIND", 0, "Generate levels with KIND: wfc, the default, caves, or mixed, where each level is one or the other depending on the seed. A saved game keeps the kind it was started with.", 0},
+    { "headless", 'H', "FILE", OPTION_ARG_OPTIONAL, "Run without a display, reading keys from FILE, or from standard input if FILE is omitted. Exits once the input runs out.", 0},
     {0}
 };
 
@@ -151,6 +158,8 @@ struct arguments
 {
     char *args[2];
     char *team;
+    char *replay;
+    char *seed;
     int debug, practice;
 };
 static struct argp argp = { options, parse_args, 0, doc, 0, 0, 0 };
@@ -172,6 +181,35 @@ error_t parse_args(int key, char *arg, struct argp_state *state) {
         case 't':
             snprintf(g.userbuf, sizeof(g.userbuf), "%s", arg);
             break;
+        case 'f':
+            term.max_fps = max(0, atoi(arg));
+            break;
+        case 'a':
+            set_autosave_interval(atoi(arg));
+            break;
+        case 's':
+            arguments->seed = arg;
+            break;
+        case 'k':
+            journal_set_keep(1);
+            break;
+        case 'm':
+            if (!strcmp(arg, "wfc"))
+                set_mapgen(MAPGEN_WFC);
+            else if (!strcmp(arg, "caves"))
+                set_mapgen(MAPGEN_CAVES);
+            else if (!strcmp(arg, "mixed"))
+                set_mapgen(MAPGEN_MIXED);
+            else
+                argp_error(state, "KIND must be wfc, caves or mixed.");
+            break;
+        case 'r':
+            arguments->replay = arg;
+            break;
+        case 'H':
+            windowprocs = headless_procs;
+            headless_set_input(arg);
+            break;
         case ARGP_KEY_ARG:
             if (state->arg_num >= 5)
                 argp_usage(state);
@@ -201,6 +239,9 @@ int main(int argc, char **argv) {
     arguments.debug = 0;
     arguments.practice = 0;
     arguments.team = '\0';
+    arguments.replay = NULL;
+    arguments.seed = NULL;
+    windowprocs = curses_procs;
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
     if (g.userbuf[0] == '\0')
         getlogin_r(g.userbuf, sizeof(g.userbuf));
@@ -218,16 +259,28 @@ int main(int argc, char **argv) {
     snprintf(buf, sizeof(buf), "%s.sav", g.userbuf);
 
     // Seed the rng
-    rndseed_t();
-
-    // Set up the screen
-    setup_screen();
-    title_screen();
-    if (file_exists(buf)) {
-        load_game(buf);
-        logma(CYAN, "Welcome back, Team %s! It's go time!", g.userbuf);
-    } else {
+    if (arguments.seed != NULL)
+        rndseed(strtoull(arguments.seed, NULL, 0));
+    else
+        rndseed_t();
+
+    if (arguments.replay != NULL) {
+        /* Replay a journal from the start of its game, drawing nothing. */
+        windowprocs = headless_procs;
+        journal_replay_file(arguments.replay);
+        setup_screen();
         new_game();
+    } else {
+        // Set up the screen
+        setup_screen();
+        title_screen();
+        if (file_exists(buf) && !load_game(buf)) {
+            logma(CYAN, "Welcome back, Team %s! It's go time!", g.userbuf);
+            journal_open(1);
+        } else {
+            new_game();
+            journal_open(0);
+        }
     }
     
     /* Main Loop */
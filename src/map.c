@@ -64,6 +64,8 @@ int make_visible(int x, int y) {
         /* TODO: Find somewhere less expensive to put this... */
         stop_running();
     }
+    if (!g.levmap[x][y].visible)
+        mark_refresh(x, y);
     g.levmap[x][y].visible = 1;
     g.levmap[x][y].explored = 1;
     if (is_opaque(x, y))
@@ -80,8 +82,8 @@ struct coord rand_open_coord(void) {
     int x, y;
 
     do {
-        x = rndmx(MAPW);
-        y = rndmx(MAPH);
+        x = rndmx(RNG_SPAWN, MAPW);
+        y = rndmx(RNG_SPAWN, MAPH);
     } while (is_blocked(x, y) || g.levmap[x][y].actor);
 
     struct coord c = {x, y};
@@ -117,7 +119,7 @@ int magic_mapping(void) {
  * @return int The cost in energy of climbing.
  */
 int change_depth(int change) {
-    save_game();
+    save_game_async();
     g.depth += change;
     if (g.depth > g.max_depth)
         update_max_depth();
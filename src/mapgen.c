@@ -11,73 +11,232 @@
  */
 
 #define WFC_IMPLEMENTATION
+#define WFC_RAND(rand_state) rnd_raw_from(rand_state)
+#define WFC_RAND_MAX RND_MAX
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <random.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "register.h"
 #include "message.h"
 #include "parser.h"
+#include "datapack.h"
 #include "map.h"
 #include "spawn.h"
 #include "parser.h"
 #include "mapgen.h"
 
-int wfc_magpen(void);
+struct wfc_chunks;
+
+/* Caves are grown on grids of bits, a row of the map to a run of words, so
+   that sixty-four cells are worked on at once. */
+#define CAVE_WORDS ((MAPW + 63) / 64)
+
+void run_wfc_workers(void *(*)(void *), void *, int);
+int apply_wfc_masks(struct wfc *, const struct wfc_rules *, const struct wfc_mask *, int, int, int, int, int);
+struct wfc_image *solve_wfc(const struct wfc_rules *, int, int, int, int, const struct wfc_mask *, int);
+void *run_wfc_attempts(void *);
+struct wfc_image *solve_wfc_chunked(const struct wfc_rules *, int, int, int, int, const struct wfc_mask *, int);
+void *run_wfc_chunks(void *);
+int solve_wfc_chunk(struct wfc_chunks *, int);
+int plan_stairs(struct wfc_mask *);
+int plan_set_piece(struct wfc_mask *, int);
+void place_stairs(void);
 void tunnel(struct coord, struct coord);
 struct coord rand_region_coord(int, int, int, int);
+void cave_row_sums(const uint64_t *, int, uint64_t *, uint64_t *);
+void cave_step(uint64_t [][CAVE_WORDS], uint64_t [][CAVE_WORDS], int, int);
+void cave_spread(uint64_t [][CAVE_WORDS], uint64_t [][CAVE_WORDS], int, int);
+int dig_corridor(uint64_t [][CAVE_WORDS], uint64_t [][CAVE_WORDS], uint64_t [][CAVE_WORDS], struct coord, int, int);
+void join_caves(uint64_t [][CAVE_WORDS], uint64_t [][CAVE_WORDS], uint64_t [][CAVE_WORDS], struct coord, int, int, int);
 void cellular_automata(int, int, int, int, int, int);
+void join_level(int, int, int, int, int, const struct wfc_mask *, int);
 int deisolate(void);
 void init_map(int);
 
-#define WFC_SUCCESS 0
-#define WFC_ERROR 1
 #define WFC_TRIES 10
+#define WFC_TILE_SIZE 2
+
+/* The pixels of the wfc input image that become floor. */
+#define FLOOR_PIXELS ".123456789"
+
+/* The most threads that wfc runs on, counting the main one. */
+#define MAX_WFC_WORKERS 4
+
+/* Sections of the map wider or taller than two chunks are generated a chunk
+   at a time. A chunk is solved along with this many cells of the chunks
+   around it, so that it has room to meet the ones already solved. */
+#define WFC_CHUNK_SIZE 48
+#define WFC_CHUNK_OVERLAP 4
+
+/* How caves are grown: the percentage of cells that start filled, how many
+   generations the automaton runs for, and the fewest cells a cave needs to
+   be joined to the rest rather than filled in. */
+#define CAVE_FILL 45
+#define CAVE_STEPS 4
+#define CAVE_MIN_SIZE 16
+
+/* When levels are mixed, one in this many is caves. */
+#define CAVE_ODDS 3
+
+/* One level in this many gets a set piece, if the wfc data file has any. A
+   set piece is at most this many cells. */
+#define SET_PIECE_ODDS 2
+#define MAX_SET_PIECE_CELLS 64
+
+struct mapgen_stats mapgen_stats;
+
+/* The wfc data file that levels are generated from. */
+static const char *wfc_rules_file = "data/wfc/dungeon.json";
+
+/* How levels are generated, one of the MAPGEN_ values. */
+static int mapgen_kind = MAPGEN_WFC;
+
+/* How the level being generated is, MAPGEN_WFC or MAPGEN_CAVES. */
+static int level_kind = MAPGEN_WFC;
+
+/* Set pieces for add_set_piece. Each is a block cut out of the input image
+   of the wfc data file it goes with, so that every tile in it is one the
+   rules know how to surround. */
+struct set_piece {
+    const char *fname;
+    const char *rows[12];
+};
+
+static const struct set_piece set_pieces[] = {
+    { "data/wfc/dungeon.json",
+      { "####+#",
+        "+1111#",
+        "#1111#",
+        "#1111#",
+        "#1111+",
+        "#+####",
+        NULL } },
+    { "data/wfc/dungeon_big.json",
+      { "###.###",
+        "#.....#",
+        "#.....#",
+        "......#",
+        "#.....#",
+        "#.....#",
+        "#.....#",
+        "#.....#",
+        "###.###",
+        NULL } },
+};
+
+/* The attempts at one section of the map, shared by the threads that make
+   them. Attempt i draws only from rngs[i], so what it produces does not
+   depend on which thread runs it or when. */
+struct wfc_attempts {
+    const struct wfc_rules *rules;
+    int x;
+    int y;
+    int width;
+    int height;
+    const struct wfc_mask *masks;
+    int mask_count;
+    struct rng rngs[WFC_TRIES];
+    struct wfc_image *results[WFC_TRIES];
+    long backtracks[WFC_TRIES];
+    int cancel[WFC_TRIES]; /* Set once an earlier attempt has succeeded. */
+    int next;
+    pthread_mutex_t lock;
+};
+
+/* A section of the map cut into a grid of chunks, shared by the threads that
+   solve them. The chunks are solved in four phases, by whether their column
+   and row in the grid are odd, so that no two chunks solved at the same time
+   touch, even at a corner. Chunk i draws only from rngs[i]. */
+struct wfc_chunks {
+    const struct wfc_rules *rules;
+    int x;
+    int y;
+    int width;
+    int height;
+    const struct wfc_mask *masks;
+    int mask_count;
+    int cols;
+    int rows;
+    int phase;
+    int *tiles;              /* The tile of every solved cell, or -1. */
+    struct wfc_image *image; /* The section, filled in as chunks are solved. */
+    struct rng *rngs;
+    int attempts;
+    int contradictions;
+    long backtracks;
+    int failed;
+    int next;
+    pthread_mutex_t lock;
+};
 
 /**
- * @brief Generate a section of the map using wave function collapse.
+ * @brief Generate a section using wave function collapse, as pixels of the
+ wfc input image. The rules are compiled once and kept for every later
+ level. Small sections are solved whole, and large ones a chunk at a time so
+ that the time taken grows with their area and no faster, falling back to
+ solving them whole if the chunks cannot be made to fit together. Masked
+ cells are limited before every run, and what that rules out is propagated
+ along with everything else, so the rest of the section is built to fit
+ around them.
+ * 
+ * @param x The x of the map that the section starts at.
+ * @param y The y of the map that the section starts at.
+ * @param width The width of the section.
+ * @param height The height of the section.
+ * @param masks Cells to limit, in map coordinates.
+ * @param mask_count How many there are.
+ * @param pixels Where to write the section, a row at a time.
+ * @return int WFC_SUCCESS or WFC_ERROR
+ */
+int wfc_generate(int x, int y, int width, int height, const struct wfc_mask *masks, int mask_count,
+                 unsigned char *pixels) {
+    const struct wfc_rules *rules = load_wfc_rules(wfc_rules_file);
+    struct wfc_image *output_image = NULL;
+
+    if (rules == NULL) {
+        logm("Error: cannot create wfc.");
+        return WFC_ERROR;
+    }
+    mapgen_stats.chunked = width > 2 * WFC_CHUNK_SIZE || height > 2 * WFC_CHUNK_SIZE;
+    if (mapgen_stats.chunked)
+        output_image = solve_wfc_chunked(rules, x, y, width, height, masks, mask_count);
+    if (output_image == NULL)
+        output_image = solve_wfc(rules, x, y, width, height, masks, mask_count);
+    if (output_image == NULL)
+        return WFC_ERROR;
+    memcpy(pixels, output_image->data, (size_t) width * height);
+    wfc_img_destroy(output_image);
+    return WFC_SUCCESS;
+}
+
+/**
+ * @brief Generate a section of the map using wave function collapse. See
+ wfc_generate.
  * 
  * @param x1 start x
  * @param y1 start y
  * @param x2 end x (inclusive)
  * @param y2 end y (inclusive)
+ * @param masks Cells to limit, in map coordinates.
+ * @param mask_count How many there are.
  * @return int WFC_SUCCESS or WFC_ERROR
  */
-int wfc_mapgen(int x1, int y1, int x2, int y2) {
-    struct wfc_image image = parse_wfc_json("data/wfc/dungeon.json");
-    int img_w = x2 - x1;
-    int img_h = y2 - y1;
-    struct wfc *wfc = wfc_overlapping(img_w,
-                                    img_h,
-                                    &image,
-                                    2,
-                                    2,
-                                    1,
-                                    1,
-                                    1,
-                                    1); 
-
-    if (wfc == NULL) {
-        logm("Error: cannot create wfc.");
-        wfc_destroy(wfc);
-        return WFC_ERROR;
-    }
+int wfc_mapgen(int x1, int y1, int x2, int y2, const struct wfc_mask *masks, int mask_count) {
+    unsigned char pixels[MAPW * MAPH];
+    int img_w = x2 - x1 + 1;
+    int img_h = y2 - y1 + 1;
 
-    if (!wfc_run(wfc, -1)) {
-        logm("Error: Something went wrong with wfc.");
-        wfc_destroy(wfc);
+    if (wfc_generate(x1, y1, img_w, img_h, masks, mask_count, pixels) != WFC_SUCCESS)
         return WFC_ERROR;
-    }
-    struct wfc_image *output_image = wfc_output_image(wfc);
-    if (!output_image) {
-        logm("Error: FAILURE.");
-        wfc_destroy(wfc);
-        return WFC_ERROR;
-    }
-    for (int y = 0; y <= img_h; y++) {
-        for (int x = 0; x <= img_w; x++) {
-            unsigned char cell = output_image->data[y * img_w + x];
+    for (int y = 0; y < img_h; y++) {
+        for (int x = 0; x < img_w; x++) {
+            unsigned char cell = pixels[y * img_w + x];
             if (cell == '.' || (cell >= '1' && cell <= '9')) {
                 init_tile(&g.levmap[x + x1][y + y1], T_FLOOR);
             } else if (cell == '+') {
@@ -87,12 +246,327 @@ int wfc_mapgen(int x1, int y1, int x2, int y2) {
             }
         }
     }
-    /* Clean leftover data from xml parser. Technically handled by wfc.h? */
-    free(image.data);
-    /* Clean other memory. */
+    return WFC_SUCCESS;
+}
+
+/**
+ * @brief Run a function on a few threads at once, the main one included,
+ and wait for all of them to return. Each call is expected to take work from
+ its argument until there is none left.
+ * 
+ * @param fn The function to run.
+ * @param arg What to pass to it.
+ * @param jobs How many pieces of work there are, so that no more threads are
+ started than could be kept busy.
+ */
+void run_wfc_workers(void *(*fn)(void *), void *arg, int jobs) {
+    pthread_t threads[MAX_WFC_WORKERS - 1];
+    int nthreads = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = min(min(jobs, MAX_WFC_WORKERS), max(ncpus, 1)) - 1;
+
+    while (nthreads < want && !pthread_create(&threads[nthreads], NULL, fn, arg))
+        nthreads++;
+    /* The main thread works too, and copes on its own if no threads could
+       be started. */
+    fn(arg);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/**
+ * @brief Limit the cells of a wfc that are masked, after it has been reset
+ and before it runs.
+ * 
+ * @param wfc The wfc.
+ * @param rules The rules it follows.
+ * @param masks The masks, in map coordinates.
+ * @param mask_count How many there are.
+ * @param x The x of the map that the wfc starts at.
+ * @param y The y of the map that the wfc starts at.
+ * @param w The width of the wfc.
+ * @param h The height of the wfc.
+ * @return int 1, or 0 if there was no memory to work out the masks.
+ */
+int apply_wfc_masks(struct wfc *wfc, const struct wfc_rules *rules, const struct wfc_mask *masks,
+                    int mask_count, int x, int y, int w, int h) {
+    uint64_t *tiles;
+
+    if (!mask_count)
+        return 1;
+    tiles = malloc(sizeof(uint64_t) * wfc_rules_words(rules));
+    if (tiles == NULL)
+        return 0;
+    for (int i = 0; i < mask_count; i++) {
+        if (masks[i].x < x || masks[i].x >= x + w || masks[i].y < y || masks[i].y >= y + h)
+            continue;
+        wfc_rules_pixel_tiles(rules, (const unsigned char *) masks[i].pixels, masks[i].count, tiles);
+        wfc_restrict_tiles(wfc, masks[i].x - x, masks[i].y - y, tiles);
+    }
+    free(tiles);
+    return 1;
+}
+
+/**
+ * @brief Solve a section of the map whole. Attempts are made side by side on
+ a few threads, and the first of them in order that succeeds is kept, so the
+ map comes out the same however the threads are scheduled. Later attempts
+ are cancelled as soon as an earlier one succeeds.
+ * 
+ * @param rules The rules to follow.
+ * @param x The x of the map that the section starts at.
+ * @param y The y of the map that the section starts at.
+ * @param width The width of the section.
+ * @param height The height of the section.
+ * @param masks Cells to limit, in map coordinates.
+ * @param mask_count How many there are.
+ * @return struct wfc_image* The section, or NULL if every attempt failed.
+ */
+struct wfc_image *solve_wfc(const struct wfc_rules *rules, int x, int y, int width, int height,
+                            const struct wfc_mask *masks, int mask_count) {
+    struct wfc_attempts attempts = { 0 };
+    struct wfc_image *output_image = NULL;
+
+    attempts.rules = rules;
+    attempts.x = x;
+    attempts.y = y;
+    attempts.width = width;
+    attempts.height = height;
+    attempts.masks = masks;
+    attempts.mask_count = mask_count;
+    /* One draw, however many attempts it takes. */
+    rnd_fork(RNG_MAPGEN, attempts.rngs, WFC_TRIES);
+    pthread_mutex_init(&attempts.lock, NULL);
+    run_wfc_workers(run_wfc_attempts, &attempts, WFC_TRIES);
+    pthread_mutex_destroy(&attempts.lock);
+
+    for (int i = 0; i < WFC_TRIES; i++) {
+        if (output_image != NULL) {
+            wfc_img_destroy(attempts.results[i]);
+            continue;
+        }
+        mapgen_stats.attempts++;
+        mapgen_stats.backtracks += attempts.backtracks[i];
+        if (attempts.results[i] != NULL) {
+            output_image = attempts.results[i];
+        } else {
+            mapgen_stats.contradictions++;
+            logm("Error: Something went wrong with wfc.");
+        }
+    }
+    return output_image;
+}
+
+/**
+ * @brief Make wfc attempts until every one has been taken or cancelled. Run
+ by each thread of solve_wfc, with a wfc of its own that is reset between
+ attempts rather than rebuilt. An attempt backtracks out of contradictions by
+ itself and only fails once it has run out of backtracks.
+ * 
+ * @param arg The struct wfc_attempts.
+ * @return void* NULL.
+ */
+void *run_wfc_attempts(void *arg) {
+    struct wfc_attempts *attempts = arg;
+    struct wfc *wfc = NULL;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock(&attempts->lock);
+        i = attempts->next++;
+        pthread_mutex_unlock(&attempts->lock);
+        if (i >= WFC_TRIES || __atomic_load_n(&attempts->cancel[i], __ATOMIC_RELAXED))
+            break;
+        if (wfc == NULL) {
+            wfc = wfc_from_rules(attempts->width, attempts->height, attempts->rules, &attempts->rngs[i]);
+            if (wfc == NULL)
+                break;
+        } else {
+            wfc_set_rand_state(wfc, &attempts->rngs[i]);
+            wfc_init(wfc);
+        }
+        wfc_set_cancel(wfc, &attempts->cancel[i]);
+        if (!apply_wfc_masks(wfc, attempts->rules, attempts->masks, attempts->mask_count,
+                             attempts->x, attempts->y, attempts->width, attempts->height))
+            continue;
+        if (!wfc_run(wfc, -1)) {
+            attempts->backtracks[i] = wfc_backtrack_cnt(wfc);
+            continue;
+        }
+        attempts->backtracks[i] = wfc_backtrack_cnt(wfc);
+        attempts->results[i] = wfc_output_image(wfc);
+        if (attempts->results[i] == NULL)
+            continue;
+        for (int j = i + 1; j < WFC_TRIES; j++)
+            __atomic_store_n(&attempts->cancel[j], 1, __ATOMIC_RELAXED);
+    }
+    wfc_destroy(wfc);
+    return NULL;
+}
+
+/**
+ * @brief Solve a section of the map a chunk at a time, the chunks of each
+ phase in parallel. Every chunk is solved along with the cells of its
+ neighbours that it overlaps, and the solved cells just outside of those are
+ fixed before it starts, so that it joins up with what is already there.
+ * 
+ * @param rules The rules to follow.
+ * @param x The x of the map that the section starts at.
+ * @param y The y of the map that the section starts at.
+ * @param width The width of the section.
+ * @param height The height of the section.
+ * @param masks Cells to limit, in map coordinates.
+ * @param mask_count How many there are.
+ * @return struct wfc_image* The section, or NULL if a chunk could not be
+ solved.
+ */
+struct wfc_image *solve_wfc_chunked(const struct wfc_rules *rules, int x, int y, int width, int height,
+                                    const struct wfc_mask *masks, int mask_count) {
+    struct wfc_chunks chunks = { 0 };
+    int count;
+
+    chunks.rules = rules;
+    chunks.x = x;
+    chunks.y = y;
+    chunks.width = width;
+    chunks.height = height;
+    chunks.masks = masks;
+    chunks.mask_count = mask_count;
+    chunks.cols = (width + WFC_CHUNK_SIZE - 1) / WFC_CHUNK_SIZE;
+    chunks.rows = (height + WFC_CHUNK_SIZE - 1) / WFC_CHUNK_SIZE;
+    count = chunks.cols * chunks.rows;
+    chunks.tiles = malloc(sizeof(int) * width * height);
+    chunks.rngs = malloc(sizeof(struct rng) * count);
+    chunks.image = wfc_img_create(width, height, rules->component_cnt);
+    if (chunks.tiles == NULL || chunks.rngs == NULL || chunks.image == NULL)
+        panik("Ran out of memory while generating the map.\n");
+    for (int i = 0; i < width * height; i++)
+        chunks.tiles[i] = -1;
+    /* One draw, however many chunks there are. */
+    rnd_fork(RNG_MAPGEN, chunks.rngs, count);
+    pthread_mutex_init(&chunks.lock, NULL);
+    for (chunks.phase = 0; chunks.phase < 4 && !chunks.failed; chunks.phase++) {
+        chunks.next = 0;
+        run_wfc_workers(run_wfc_chunks, &chunks, (chunks.cols + 1) / 2 * ((chunks.rows + 1) / 2));
+    }
+    pthread_mutex_destroy(&chunks.lock);
+    mapgen_stats.attempts += chunks.attempts;
+    mapgen_stats.contradictions += chunks.contradictions;
+    mapgen_stats.backtracks += chunks.backtracks;
+
+    free(chunks.tiles);
+    free(chunks.rngs);
+    if (chunks.failed) {
+        logm("Error: The chunks of the map did not fit together.");
+        wfc_img_destroy(chunks.image);
+        return NULL;
+    }
+    return chunks.image;
+}
+
+/**
+ * @brief Solve the chunks of the current phase until every one has been
+ taken. Run by each thread of solve_wfc_chunked.
+ * 
+ * @param arg The struct wfc_chunks.
+ * @return void* NULL.
+ */
+void *run_wfc_chunks(void *arg) {
+    struct wfc_chunks *chunks = arg;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock(&chunks->lock);
+        i = chunks->next++;
+        pthread_mutex_unlock(&chunks->lock);
+        if (i >= chunks->cols * chunks->rows || __atomic_load_n(&chunks->failed, __ATOMIC_RELAXED))
+            return NULL;
+        if ((i % chunks->cols) % 2 != (chunks->phase & 1) || (i / chunks->cols) % 2 != chunks->phase >> 1)
+            continue;
+        if (!solve_wfc_chunk(chunks, i))
+            __atomic_store_n(&chunks->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Solve one chunk and the cells it overlaps, trying again from a clean
+ slate if it cannot be made to fit, and copy it into the section over
+ whatever was there.
+ * 
+ * @param chunks The section being solved.
+ * @param i The index of the chunk.
+ * @return int 1 if the chunk was solved, 0 otherwise.
+ */
+int solve_wfc_chunk(struct wfc_chunks *chunks, int i) {
+    int cc = chunks->image->component_cnt;
+    /* The chunk with its overlap, and a margin of one cell around that. */
+    int x0 = max((i % chunks->cols) * chunks->width / chunks->cols - WFC_CHUNK_OVERLAP, 0);
+    int x1 = min((i % chunks->cols + 1) * chunks->width / chunks->cols + WFC_CHUNK_OVERLAP, chunks->width);
+    int y0 = max((i / chunks->cols) * chunks->height / chunks->rows - WFC_CHUNK_OVERLAP, 0);
+    int y1 = min((i / chunks->cols + 1) * chunks->height / chunks->rows + WFC_CHUNK_OVERLAP, chunks->height);
+    int mx = max(x0 - 1, 0);
+    int my = max(y0 - 1, 0);
+    int w = min(x1 + 1, chunks->width) - mx;
+    int h = min(y1 + 1, chunks->height) - my;
+    struct wfc_image *output_image;
+    struct wfc *wfc;
+    long backtracks = 0;
+    int solved = 0;
+    int tries;
+    int tile;
+
+    wfc = wfc_from_rules(w, h, chunks->rules, &chunks->rngs[i]);
+    if (wfc == NULL)
+        return 0;
+    for (tries = 0; tries < WFC_TRIES; tries++) {
+        if (tries)
+            wfc_init(wfc);
+        for (int y = my; y < my + h; y++) {
+            for (int x = mx; x < mx + w; x++) {
+                if (x >= x0 && x < x1 && y >= y0 && y < y1)
+                    continue;
+                tile = chunks->tiles[y * chunks->width + x];
+                if (tile >= 0)
+                    wfc_fix_tile(wfc, x - mx, y - my, tile);
+            }
+        }
+        if (!apply_wfc_masks(wfc, chunks->rules, chunks->masks, chunks->mask_count,
+                             chunks->x + mx, chunks->y + my, w, h))
+            continue;
+        solved = wfc_run(wfc, -1);
+        backtracks += wfc_backtrack_cnt(wfc);
+        if (solved)
+            break;
+    }
+    __atomic_add_fetch(&chunks->attempts, tries + solved, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&chunks->contradictions, tries, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&chunks->backtracks, backtracks, __ATOMIC_RELAXED);
+    if (tries >= WFC_TRIES || (output_image = wfc_output_image(wfc)) == NULL) {
+        wfc_destroy(wfc);
+        return 0;
+    }
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            chunks->tiles[y * chunks->width + x] = wfc_tile_at(wfc, x - mx, y - my);
+            memcpy(&chunks->image->data[(y * chunks->width + x) * cc],
+                   &output_image->data[((y - my) * w + x - mx) * cc], cc);
+        }
+    }
     wfc_img_destroy(output_image);
     wfc_destroy(wfc);
-    return WFC_SUCCESS;
+    return 1;
+}
+
+/**
+ * @brief Compile the rules for wave function collapse from an input image,
+ cut into tiles the way the level generator expects.
+ * 
+ * @param image The input image.
+ * @return struct wfc_rules* The rules, or NULL on error. Destroyed with
+ wfc_rules_destroy().
+ */
+struct wfc_rules *compile_wfc_rules(struct wfc_image *image) {
+    return wfc_overlapping_rules(image, WFC_TILE_SIZE, WFC_TILE_SIZE, 1, 1, 1, 1);
 }
 
 /**
@@ -105,78 +579,356 @@ int wfc_mapgen(int x1, int y1, int x2, int y2) {
 struct coord rand_region_coord(int x1, int y1, int x2, int y2) {
     struct coord c;
     do {
-        c.x = rndrng(x1, x2);
-        c.y = rndrng(y1, y2);
+        c.x = rndrng(RNG_MAPGEN, x1, x2);
+        c.y = rndrng(RNG_MAPGEN, y1, y2);
     } while (is_blocked(c.x, c.y));
     return c;
 }
 
+/**
+ * @brief Find the neighbours of every cell of a row of caves: for each bit
+ of the row, the sum of it and the bits either side, as a two bit number
+ spread over two words. Cells off the edge of the row count as filled.
+ * 
+ * @param row The row's words.
+ * @param words How many words there are.
+ * @param lo Where to write the low bit of every sum.
+ * @param hi Where to write the high bit of every sum.
+ */
+void cave_row_sums(const uint64_t *row, int words, uint64_t *lo, uint64_t *hi) {
+    for (int w = 0; w < words; w++) {
+        uint64_t prev = w ? row[w - 1] : ~0ULL;
+        uint64_t next = w + 1 < words ? row[w + 1] : ~0ULL;
+        uint64_t left = row[w] << 1 | prev >> 63;
+        uint64_t right = row[w] >> 1 | next << 63;
+
+        lo[w] = left ^ row[w] ^ right;
+        hi[w] = (left & row[w]) | (right & (left ^ row[w]));
+    }
+}
+
+/**
+ * @brief Run one generation of the cave automaton. A cell is filled if at
+ least five of the nine cells around and including it are filled, where
+ cells outside the region count as filled. Every generation is read from one
+ grid and written to the other, so that no cell sees a neighbour that has
+ already moved on. Sixty-four cells are counted at once, with adders made of
+ bitwise operations.
+ * 
+ * @param from The grid to read, one bit per cell, set if filled.
+ * @param to The grid to write.
+ * @param width The width of the region.
+ * @param height The height of the region.
+ */
+void cave_step(uint64_t from[][CAVE_WORDS], uint64_t to[][CAVE_WORDS], int width, int height) {
+    uint64_t lo[MAPH][CAVE_WORDS], hi[MAPH][CAVE_WORDS];
+    uint64_t edge[CAVE_WORDS];
+    int words = (width + 63) / 64;
+    uint64_t pad = width % 64 ? ~0ULL << (width % 64) : 0;
+
+    /* Beyond the top and bottom every sum is three. */
+    for (int w = 0; w < words; w++)
+        edge[w] = ~0ULL;
+    for (int y = 0; y < height; y++)
+        cave_row_sums(from[y], words, lo[y], hi[y]);
+    for (int y = 0; y < height; y++) {
+        for (int w = 0; w < words; w++) {
+            uint64_t a0 = y ? lo[y - 1][w] : edge[w];
+            uint64_t a1 = y ? hi[y - 1][w] : edge[w];
+            uint64_t c0 = y + 1 < height ? lo[y + 1][w] : edge[w];
+            uint64_t c1 = y + 1 < height ? hi[y + 1][w] : edge[w];
+            uint64_t b0 = lo[y][w];
+            uint64_t b1 = hi[y][w];
+            /* Add the low bits, carrying into the twos. */
+            uint64_t ones = a0 ^ b0 ^ c0;
+            uint64_t carry = (a0 & b0) | (c0 & (a0 ^ b0));
+            /* Count the four twos. */
+            uint64_t twos = a1 ^ b1 ^ c1;
+            uint64_t fours = (a1 & b1) | (c1 & (a1 ^ b1));
+            uint64_t odd = twos ^ carry;
+            uint64_t more = fours | (twos & carry);
+            uint64_t all = fours & twos & carry;
+
+            /* At least five means at least two twos, and then either a one,
+               or a third two. */
+            to[y][w] = (more & (ones | odd | all)) | (w == words - 1 ? pad : 0);
+        }
+    }
+}
+
+/**
+ * @brief Spread out from cells already reached to every open cell that
+ touches one, including at a corner, until there are no more. Each row is
+ updated in place, so what is reached in one row spreads into the next in
+ the same pass.
+ * 
+ * @param open The cells that can be reached.
+ * @param reach The cells reached, which grows.
+ * @param words How many words there are in a row.
+ * @param height The height of the region.
+ */
+void cave_spread(uint64_t open[][CAVE_WORDS], uint64_t reach[][CAVE_WORDS], int words, int height) {
+    int changed = 1;
+
+    while (changed) {
+        changed = 0;
+        for (int y = 0; y < height; y++) {
+            for (int w = 0; w < words; w++) {
+                uint64_t near = 0;
+                uint64_t next;
+
+                for (int dy = -1; dy <= 1; dy++) {
+                    const uint64_t *row;
+                    if (y + dy < 0 || y + dy >= height)
+                        continue;
+                    row = reach[y + dy];
+                    near |= row[w] | row[w] << 1 | row[w] >> 1;
+                    if (w)
+                        near |= row[w - 1] >> 63;
+                    if (w + 1 < words)
+                        near |= row[w + 1] << 63;
+                }
+                next = near & open[y][w];
+                if (next != reach[y][w]) {
+                    reach[y][w] = next;
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Dig a corridor from a cell to the nearest cell already reached,
+ through as few closed cells as it can, stepping only straight so that it
+ can be walked without cutting corners. Fixed cells are never dug through.
+ * 
+ * @param open The open cells, which gain the corridor.
+ * @param reach The cells already reached.
+ * @param fixed Cells that must not be dug through, or NULL.
+ * @param from The cell to dig from.
+ * @param width The width of the region.
+ * @param height The height of the region.
+ * @return int 1 if a corridor was dug, 0 if the fixed cells are in the way.
+ */
+int dig_corridor(uint64_t open[][CAVE_WORDS], uint64_t reach[][CAVE_WORDS], uint64_t fixed[][CAVE_WORDS],
+                 struct coord from, int width, int height) {
+    static const int dirs[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+    /* Stepping into an open cell costs nothing, so it goes on the front of
+       the queue, and into a closed one costs a cell dug, so on the back. */
+    int queue[2 * MAPW * MAPH];
+    int dist[MAPW * MAPH];
+    int prev[MAPW * MAPH];
+    int head = MAPW * MAPH;
+    int tail = head;
+    int found = -1;
+
+    for (int i = 0; i < width * height; i++)
+        dist[i] = INT_MAX;
+    dist[from.y * width + from.x] = 0;
+    prev[from.y * width + from.x] = -1;
+    queue[tail++] = from.y * width + from.x;
+    while (head < tail && found < 0) {
+        int cur = queue[head++];
+        int x = cur % width;
+        int y = cur / width;
+
+        if (reach[y][x / 64] >> (x % 64) & 1) {
+            found = cur;
+            break;
+        }
+        for (int i = 0; i < 4; i++) {
+            int nx = x + dirs[i][0];
+            int ny = y + dirs[i][1];
+            int next = ny * width + nx;
+            int cost;
+            if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+                continue;
+            cost = !(open[ny][nx / 64] >> (nx % 64) & 1);
+            if (cost && fixed && fixed[ny][nx / 64] >> (nx % 64) & 1)
+                continue;
+            if (dist[cur] + cost >= dist[next])
+                continue;
+            dist[next] = dist[cur] + cost;
+            prev[next] = cur;
+            if (cost)
+                queue[tail++] = next;
+            else
+                queue[--head] = next;
+        }
+    }
+    if (found < 0)
+        return 0;
+    for (int i = found; i >= 0; i = prev[i])
+        open[i / width][i % width / 64] |= 1ULL << (i % width % 64);
+    return 1;
+}
+
+/**
+ * @brief Join the caves, so that every open cell can be reached from the
+ anchor. Each cave not yet reached is either filled in, if it is smaller
+ than min_size and holds no kept or fixed cell, or joined by a corridor dug
+ from it to the nearest cave already reached.
+ * 
+ * @param open The open cells, which gain the corridors and lose the caves
+ filled in.
+ * @param keep Cells that must stay open.
+ * @param fixed Cells that must not change, so that corridors go around
+ them where they can.
+ * @param anchor The cell everything is joined to, relative to the region.
+ * @param width The width of the region.
+ * @param height The height of the region.
+ * @param min_size The fewest cells a cave needs to be joined.
+ */
+void join_caves(uint64_t open[][CAVE_WORDS], uint64_t keep[][CAVE_WORDS], uint64_t fixed[][CAVE_WORDS],
+                struct coord anchor, int width, int height, int min_size) {
+    uint64_t reach[MAPH][CAVE_WORDS] = { 0 };
+    uint64_t rest[MAPH][CAVE_WORDS];
+    uint64_t cave[MAPH][CAVE_WORDS];
+    int words = (width + 63) / 64;
+
+    reach[anchor.y][anchor.x / 64] = 1ULL << (anchor.x % 64);
+    cave_spread(open, reach, words, height);
+    for (;;) {
+        struct coord c = { -1, -1 };
+        int size = 0;
+        int kept = 0;
+
+        /* Find the first open cell not reached yet. */
+        for (int y = 0; y < height; y++) {
+            for (int w = 0; w < words; w++) {
+                rest[y][w] = open[y][w] & ~reach[y][w];
+                cave[y][w] = 0;
+                if (c.x < 0 && rest[y][w]) {
+                    c.x = w * 64 + __builtin_ctzll(rest[y][w]);
+                    c.y = y;
+                }
+            }
+        }
+        if (c.x < 0)
+            break;
+        cave[c.y][c.x / 64] = 1ULL << (c.x % 64);
+        cave_spread(rest, cave, words, height);
+        for (int y = 0; y < height; y++) {
+            for (int w = 0; w < words; w++) {
+                size += __builtin_popcountll(cave[y][w]);
+                kept |= (cave[y][w] & (keep[y][w] | fixed[y][w])) != 0;
+            }
+        }
+        if (size < min_size && !kept) {
+            for (int y = 0; y < height; y++) {
+                for (int w = 0; w < words; w++)
+                    open[y][w] &= ~cave[y][w];
+            }
+            continue;
+        }
+        /* If the fixed cells wall the cave in, dig through them after all. */
+        if (!dig_corridor(open, reach, fixed, c, width, height))
+            dig_corridor(open, reach, NULL, c, width, height);
+        cave_spread(open, reach, words, height);
+    }
+}
+
 /**
  * @brief Carve out a portion of the dungeon level using a cellular automata
- algorithm.
+ algorithm. The caves it leaves are not joined; see join_level.
  * 
  * @param x1 Upper left x
- * @param x2 Lower right x
+ * @param x2 Lower right x (exclusive)
  * @param y1 Upper left y
- * @param y2 Lower right y
+ * @param y2 Lower right y (exclusive)
  * @param filled What percentage of the map should start filled
  * @param iterations How many iterations to run the automata
  */
 void cellular_automata(int x1, int y1, int x2, int y2, int filled, int iterations) {
-    int x, y, nx, ny;
-    int alive;
-    int blocked = 1;
+    uint64_t cells[2][MAPH][CAVE_WORDS];
     int width = x2 - x1;
     int height = y2 - y1;
-    unsigned char cells[width][height];
+    int words = (width + 63) / 64;
+    int cur = 0;
 
-    /* Initialize cells. */
-    for (x = 0; x < width; x++) {
-        for (y = 0; y < height; y++) {
-            cells[x][y] = (rndmx(100) < filled);
+    /* Initialize cells, with the bits past the end of each row filled. */
+    memset(cells, 0, sizeof(cells));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < words * 64; x++) {
+            if (x >= width || rndmx(RNG_MAPGEN, 100) < filled)
+                cells[cur][y][x / 64] |= 1ULL << (x % 64);
         }
     }
-    /* Game of Life */
     for (int i = 0; i < iterations; i++) {
-        for (x = 0; x < width; x++) {
-            for (y = 0; y < height; y++) {
-
-                alive = 0;
-                for (int xx1 = -1; xx1 <= 1; xx1++) {
-                    nx = x + xx1;
-                    if (nx < 0 || nx >= width) {
-                        alive += 3;
-                        continue;
-                    }
-                    for (int yy1 = -1; yy1 <= 1; yy1++) {
-                        ny = y + yy1;
-                        if (ny < 0 || ny >= height) {
-                            alive++;
-                        } else if (cells[nx][ny]) {
-                            alive++;
-                        }
-                    }
-                }
-                if (alive >= 5)
-                    cells[x][y] = 1;
-                else
-                    cells[x][y] = 0;
-            }
-        }
+        cave_step(cells[cur], cells[!cur], width, height);
+        cur = !cur;
     }
 
     /* Transfer to grid */
-    for (x = 0; x < width; x++) {
-        for (y = 0; y < height; y++) {
-            if (!cells[x][y]) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (!(cells[cur][y][x / 64] >> (x % 64) & 1))
                 init_tile(&g.levmap[x1 + x][y1 + y], T_FLOOR);
-                blocked = 0;
-            }
         }
     }
-    /* Add a single cell if none existed after running (can happen on small inputs) */
-    if (blocked) {
-        init_tile(&g.levmap[rndrng(x1, x1 + x)][rndrng(y1, y1 + 1)], T_FLOOR);
+}
+
+/**
+ * @brief Join up a portion of the dungeon level, so that every open cell in
+ it can be reached from the up stairs, or from the middle of the portion if
+ they are elsewhere. The stairs are opened first, where they fall inside it,
+ so they are always joined. Closed doors count as open.
+ * 
+ * @param x1 Upper left x
+ * @param y1 Upper left y
+ * @param x2 Lower right x (exclusive)
+ * @param y2 Lower right y (exclusive)
+ * @param min_size Caves with fewer cells than this, and no stairs, are filled
+ in rather than joined.
+ * @param masks Cells that wfc was made to build, which are left as they are
+ where possible.
+ * @param mask_count How many there are.
+ */
+void join_level(int x1, int y1, int x2, int y2, int min_size, const struct wfc_mask *masks, int mask_count) {
+    uint64_t open[MAPH][CAVE_WORDS] = { 0 };
+    uint64_t keep[MAPH][CAVE_WORDS] = { 0 };
+    uint64_t fixed[MAPH][CAVE_WORDS] = { 0 };
+    int width = x2 - x1;
+    int height = y2 - y1;
+    struct coord stairs[2] = { { g.up_x, g.up_y }, { g.down_x, g.down_y } };
+    struct coord anchor = { width / 2, height / 2 };
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (!is_wall(x1 + x, y1 + y))
+                open[y][x / 64] |= 1ULL << (x % 64);
+        }
+    }
+    for (int i = g.depth ? 1 : 0; i >= 0; i--) {
+        int x = stairs[i].x - x1;
+        int y = stairs[i].y - y1;
+        if (x < 0 || x >= width || y < 0 || y >= height)
+            continue;
+        keep[y][x / 64] |= 1ULL << (x % 64);
+        anchor = (struct coord) { x, y };
+    }
+    keep[anchor.y][anchor.x / 64] |= 1ULL << (anchor.x % 64);
+    for (int i = 0; i < mask_count; i++) {
+        int x = masks[i].x - x1;
+        int y = masks[i].y - y1;
+        if (x >= 0 && x < width && y >= 0 && y < height)
+            fixed[y][x / 64] |= 1ULL << (x % 64);
+    }
+    for (int y = 0; y < height; y++) {
+        for (int w = 0; w < CAVE_WORDS; w++)
+            open[y][w] |= keep[y][w];
+    }
+    join_caves(open, keep, fixed, anchor, width, height, min_size);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int is_open = open[y][x / 64] >> (x % 64) & 1;
+            if (is_open && is_wall(x1 + x, y1 + y))
+                init_tile(&g.levmap[x1 + x][y1 + y], T_FLOOR);
+            else if (!is_open && !is_wall(x1 + x, y1 + y))
+                init_tile(&g.levmap[x1 + x][y1 + y], T_WALL);
+        }
     }
 }
 
@@ -248,35 +1000,152 @@ void tunnel(struct coord c1, struct coord c2) {
     }
 }
 
-void place_stairs(void) {
-    struct coord stairs_xy;
-    stairs_xy = rand_region_coord(0, 0, MAPW, MAPH / 4);
-    init_tile(&g.levmap[stairs_xy.x][stairs_xy.y], T_STAIR_UP);
-    g.up_x = stairs_xy.x;
-    g.up_y = stairs_xy.y;
+/**
+ * @brief Write the masks for a set piece, a block of pixels of the wfc input
+ image that the level has to contain.
+ * 
+ * @param masks Where to write the masks. There must be room for one for each
+ cell of the set piece.
+ * @param x The x of the map that the set piece starts at.
+ * @param y The y of the map that the set piece starts at.
+ * @param rows The rows of the set piece, ending with NULL. A space leaves its
+ cell free.
+ * @return int How many masks were written.
+ */
+int add_set_piece(struct wfc_mask *masks, int x, int y, const char *const *rows) {
+    int count = 0;
+
+    for (int j = 0; rows[j] != NULL; j++) {
+        for (int i = 0; rows[j][i]; i++) {
+            if (rows[j][i] == ' ')
+                continue;
+            masks[count].x = x + i;
+            masks[count].y = y + j;
+            masks[count].pixels = &rows[j][i];
+            masks[count].count = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Choose where the stairs go, before the level is generated, and mask
+ their cells so that the level is built with floor under them.
+ * 
+ * @param masks Where to write the masks, with room for two.
+ * @return int How many masks were written.
+ */
+int plan_stairs(struct wfc_mask *masks) {
+    int count = 0;
+
+    g.up_x = rndrng(RNG_MAPGEN, 1, MAPW - 1);
+    g.up_y = rndrng(RNG_MAPGEN, 1, MAPH / 4);
+    masks[count++] = (struct wfc_mask) { g.up_x, g.up_y, FLOOR_PIXELS, sizeof(FLOOR_PIXELS) - 1 };
     if (g.depth) {
-        stairs_xy = rand_region_coord(0, MAPH * 3 / 4, MAPW, MAPH);
-        init_tile(&g.levmap[stairs_xy.x][stairs_xy.y], T_STAIR_DOWN);
-        g.down_x = stairs_xy.x;
-        g.down_y = stairs_xy.y;
+        g.down_x = rndrng(RNG_MAPGEN, 1, MAPW - 1);
+        g.down_y = rndrng(RNG_MAPGEN, MAPH * 3 / 4, MAPH - 1);
+        masks[count++] = (struct wfc_mask) { g.down_x, g.down_y, FLOOR_PIXELS, sizeof(FLOOR_PIXELS) - 1 };
     }
+    return count;
+}
+
+/**
+ * @brief Choose whether the level gets a set piece, which one, and where,
+ and mask its cells. Only the set pieces that go with the wfc data file in
+ use are considered. They are placed between the band the up stairs are
+ chosen from and the band the down stairs are, so they never cover them.
+ * 
+ * @param masks Where to write the masks.
+ * @param room How many masks there is room for.
+ * @return int How many masks were written.
+ */
+int plan_set_piece(struct wfc_mask *masks, int room) {
+    const int num_pieces = sizeof(set_pieces) / sizeof(set_pieces[0]);
+    const struct set_piece *piece = NULL;
+    int matches = 0;
+    int width, height;
+
+    for (int i = 0; i < num_pieces; i++)
+        matches += !strcmp(set_pieces[i].fname, wfc_rules_file);
+    if (!matches || rndmx(RNG_MAPGEN, SET_PIECE_ODDS))
+        return 0;
+    matches = rndmx(RNG_MAPGEN, matches);
+    for (int i = 0; i < num_pieces && piece == NULL; i++) {
+        if (!strcmp(set_pieces[i].fname, wfc_rules_file) && !matches--)
+            piece = &set_pieces[i];
+    }
+    width = strlen(piece->rows[0]);
+    for (height = 0; piece->rows[height] != NULL; height++)
+        ;
+    if (width * height > room || height > MAPH * 3 / 4 - MAPH / 4) {
+        logm_warning("Error: A set piece for %s does not fit.", wfc_rules_file);
+        return 0;
+    }
+    return add_set_piece(masks, rndrng(RNG_MAPGEN, 1, MAPW - width),
+                         rndrng(RNG_MAPGEN, MAPH / 4, MAPH * 3 / 4 - height + 1), piece->rows);
+}
+
+/**
+ * @brief Choose the wfc data file that levels are generated from.
+ * 
+ * @param fname The data file. Must be one of data_files, and outlive every
+ level generated from it.
+ */
+void set_wfc_rules(const char *fname) {
+    wfc_rules_file = fname;
+}
+
+/**
+ * @brief Choose how levels are generated.
+ * 
+ * @param kind MAPGEN_WFC, MAPGEN_CAVES or MAPGEN_MIXED.
+ */
+void set_mapgen(int kind) {
+    mapgen_kind = kind;
+}
+
+int get_mapgen(void) {
+    return mapgen_kind;
+}
+
+/**
+ * @brief Put the stairs where plan_stairs chose.
+ * 
+ */
+void place_stairs(void) {
+    init_tile(&g.levmap[g.up_x][g.up_y], T_STAIR_UP);
+    if (g.depth)
+        init_tile(&g.levmap[g.down_x][g.down_y], T_STAIR_DOWN);
 }
 
 void make_level(void) {
+    struct wfc_mask masks[2 + MAX_SET_PIECE_CELLS];
+    int mask_count;
+
     f.mode_mapgen = 1;
-    int tries;
+    memset(&mapgen_stats, 0, sizeof(mapgen_stats));
 
+    /* The layout of a level depends only on the seed and the depth. */
+    rnd_stream_seed(RNG_MAPGEN, g.depth);
+    level_kind = mapgen_kind;
+    if (mapgen_kind == MAPGEN_MIXED)
+        level_kind = rndmx(RNG_MAPGEN, CAVE_ODDS) ? MAPGEN_WFC : MAPGEN_CAVES;
+    mask_count = plan_stairs(masks);
+    if (level_kind != MAPGEN_CAVES)
+        mask_count += plan_set_piece(masks + mask_count, MAX_SET_PIECE_CELLS);
     /* Fill map */
     init_map(T_WALL);
-    /* Wave function collapse */
-    for (tries = 0; tries < WFC_TRIES; tries++) {
-        if (!wfc_mapgen(1, 1, MAPW - 2, MAPH - 2)) {
-            break;
-        }
-    }
-    /* Fallback */
-    if (tries >= WFC_TRIES) {
+    /* Caves, or wave function collapse with a fallback */
+    if (level_kind == MAPGEN_CAVES) {
+        cellular_automata(1, 1, MAPW - 1, MAPH - 1, CAVE_FILL, CAVE_STEPS);
+        join_level(1, 1, MAPW - 1, MAPH - 1, CAVE_MIN_SIZE, NULL, 0);
+    } else if (wfc_mapgen(1, 1, MAPW - 2, MAPH - 2, masks, mask_count)) {
+        mapgen_stats.fallback = 1;
         init_map(T_FLOOR);
+    } else {
+        /* Nothing in the rules keeps the rooms they build joined up. */
+        join_level(1, 1, MAPW - 1, MAPH - 1, 0, masks, mask_count);
     }
     place_stairs();
 
@@ -298,5 +1167,5 @@ void make_level(void) {
  * 
  */
 void set_spawn_countdown(void) {
-    g.spawn_countdown = rndrng(min(25, 78 - g.depth), min(50, 128 - g.depth));
+    g.spawn_countdown = rndrng(RNG_SPAWN, min(25, 78 - g.depth), min(50, 128 - g.depth));
 }
\ No newline at end of file
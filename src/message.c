@@ -22,6 +22,8 @@
 int log_string(const char *, int, va_list);
 void wrap_string(char *, int);
 
+static unsigned long msg_count = 0;
+
 /**
  * @brief Free an individual message.
  * 
@@ -112,6 +114,7 @@ int log_string(const char *format, int attr, va_list arg) {
     struct msg *new_msg = malloc(sizeof(struct msg));
     wrap_string(msgbuf, term.msg_w);
     new_msg->msg = msgbuf;
+    new_msg->id = ++msg_count;
     new_msg->turn = g.turns;
     new_msg->attr = attr;
     new_msg->next = NULL;
@@ -15,7 +15,6 @@
 #include <ctype.h>
 #include <cjson/cJSON.h>
 
-#include "message.h"
 #include "parser.h"
 #include "spawn.h"
 #include "actor.h"
@@ -26,7 +25,6 @@
 #include "spawn.h"
 
 struct cJSON* json_from_file(const char *);
-void shuffle_attributes(struct actor **, int, int, int, int);
 struct actor *actor_from_json(cJSON *);
 struct ai *ai_from_json(struct ai *, cJSON *);
 struct item *item_from_json(struct item *, cJSON *);
@@ -37,7 +35,8 @@ void color_from_json(unsigned char *, cJSON *);
 void mod_slots(struct item *);
 
 /**
- * @brief Read JSON from a file.
+ * @brief Read JSON from a file. Safe to call from any thread, so reports
+ nothing itself.
  * 
  * @param fname The name of the file to be read.
  * @return struct cJSON* A pointer to the cJSON struct. Returns NULL if 
@@ -50,10 +49,8 @@ struct cJSON* json_from_file(const char *fname) {
     cJSON *json = NULL;
     /* Read the file. */
     fp = fopen(fname, "rb");
-    if (!fp) {
-        logm_warning("Error: Could not find file: %s", fname);
+    if (!fp)
         return NULL;
-    }
     fseek(fp, 0, SEEK_END);
     len = ftell(fp);
     fseek(fp, 0, SEEK_SET);
@@ -63,10 +60,6 @@ struct cJSON* json_from_file(const char *fname) {
     fclose(fp);
     /* Parse the file into JSON. */
     json = cJSON_Parse(buf);
-    if (!json) {
-        logm_warning("Error: Could not parse JSON in file: %s", fname);
-        return NULL;
-    }
     free(buf);
     return json;
 }
@@ -124,50 +117,46 @@ struct actor *actor_from_json(cJSON *actor_json) {
 }
 
 /**
- * @brief parse a json file into an array of actors
+ * @brief Parse a json file into an array of actors, without shuffling them.
+ Safe to call from any thread, as long as each thread has its own array.
  * 
  * @param fname the file to parse
  * @param total_actors pointer to the count of total actors
- * @param actor_array pointer to the array to be written to
+ * @param actor_array pointer to the array to be written to, which must have
+ room for MAX_ACTORS actors. Anything past that is dropped.
+ * @return int The attributes that the file asks to have shuffled, as
+ SHUFFLE_* flags, or -1 if the file could not be read.
  */
-void json_to_actor_array(const char *fname, int *total_actors, struct actor **actor_array) {
+int parse_actor_file(const char *fname, int *total_actors, struct actor **actor_array) {
     cJSON *all_json = json_from_file(fname);
     cJSON *all_actors_json = NULL;
     cJSON *shuffle_json = NULL;
     cJSON *actor_json = NULL;
     struct actor *new_actor;
-    int appearance, color = 0;
-    int end;
-    int start = *total_actors;
+    int shuffle = 0;
 
-    if (!all_json) {
-        panik("Could not read json file: %s\n", fname);
-        return;
-    }
+    if (!all_json)
+        return -1;
     all_actors_json = cJSON_GetObjectItemCaseSensitive(all_json, "actors");
     shuffle_json = cJSON_GetObjectItemCaseSensitive(all_json, "shuffle");
 
     // read each one into the actor array. must be freed at a later point.
     cJSON_ArrayForEach(actor_json, all_actors_json) {
-        if (*total_actors >= MAX_ACTORS) {
-            logm_warning("MAX_ACTORS exceeded. Termination of game is recommended.");
+        if (*total_actors >= MAX_ACTORS)
             break;
-        }
         new_actor = actor_from_json(actor_json);
         new_actor->id = *total_actors;
         actor_array[*total_actors] = new_actor;
         (*total_actors)++;
     }
 
-    /* Shuffle the subsection of the array that we read in (if needed) */
-    appearance = cJSON_GetObjectItemCaseSensitive(shuffle_json, "appearance")->valueint;
-    color = cJSON_GetObjectItemCaseSensitive(shuffle_json, "color")->valueint;
-    end = *total_actors;
-    if (appearance || color)
-        shuffle_attributes(actor_array, start, end, appearance, color);
+    if (cJSON_GetObjectItemCaseSensitive(shuffle_json, "appearance")->valueint)
+        shuffle |= SHUFFLE_APPEARANCE;
+    if (cJSON_GetObjectItemCaseSensitive(shuffle_json, "color")->valueint)
+        shuffle |= SHUFFLE_COLOR;
 
-    cJSON_Delete(actor_json);
     cJSON_Delete(all_json);
+    return shuffle;
 }
 
 /**
@@ -184,7 +173,7 @@ void shuffle_attributes(struct actor **actor_array, int start, int end, int appe
     unsigned char temp_color;
     char temp[MAXNAMESIZ];
     for (int i = start; i < end; i++) {
-        swap_index = rndrng(i, end);
+        swap_index = rndrng(RNG_SPAWN, i, end);
         if (i != swap_index) {
             /* Appearance */
             if (appearance) {
@@ -377,46 +366,54 @@ void mod_slots(struct item *item) {
 }
 
 /**
- * @brief Parse a wfc image for use in wfc generation from a json file.
+ * @brief Parse a wfc image for use in wfc generation from a json file. The
+ map is either an array of rows, or a single string holding every row. Safe
+ to call from any thread.
  * 
  * @param infile The file to be parsed.
- * @return struct wfc_image The wfc image. 
+ * @return struct wfc_image The wfc image, which is empty if the file could
+ not be read. Its data must be freed by the caller.
  */
-struct wfc_image parse_wfc_json(char *infile) {
+struct wfc_image parse_wfc_json(const char *infile) {
     int width, height, offset = 0;
-    unsigned char *wfcbuf = malloc(257 * sizeof(char));
+    unsigned char *wfcbuf;
     cJSON *wfc_json = json_from_file(infile);
     cJSON *test_json = NULL;
     cJSON *line = NULL;
     cJSON* field = NULL;
-    struct wfc_image blank_image = {
-        .data = wfcbuf,
+    struct wfc_image image = {
+        .data = NULL,
         .component_cnt = 1,
         .width = 0,
         .height = 0
     };
 
-    if (!wfc_json)
-        return blank_image;
+    if (!wfc_json) {
+        image.data = calloc(1, 1);
+        return image;
+    }
     test_json = cJSON_GetObjectItemCaseSensitive(wfc_json, "standard");
     
     field = cJSON_GetObjectItemCaseSensitive(test_json, "width");
     width = field->valueint;
     field = cJSON_GetObjectItemCaseSensitive(test_json, "height");
     height = field->valueint;
+    wfcbuf = calloc(width * height + 1, 1);
     field = cJSON_GetObjectItemCaseSensitive(test_json, "map");
-    cJSON_ArrayForEach(line, field) {
-        memcpy(wfcbuf + offset, (unsigned char *) line->valuestring, sizeof(line->valuestring));
-        offset += width;
+    if (cJSON_IsString(field)) {
+        strncpy((char *) wfcbuf, field->valuestring, width * height);
+    } else {
+        cJSON_ArrayForEach(line, field) {
+            if (offset >= height * width)
+                break;
+            strncpy((char *) wfcbuf + offset, line->valuestring, width);
+            offset += width;
+        }
     }
-    wfcbuf[height * width] = '\0';
 
-    struct wfc_image image = {
-        .data = wfcbuf,
-        .component_cnt = 1,
-        .width = width,
-        .height = height
-    };
+    image.data = wfcbuf;
+    image.width = width;
+    image.height = height;
     cJSON_Delete(wfc_json);
     return image;
-}
\ No newline at end of file
+}
@@ -1,7 +1,9 @@
 /**
  * @file random.c
  * @author Kestrel (kestrelg@kestrelscry.com)
- * @brief Random number generation functions.
+ * @brief Random number generation functions. Numbers come from xoshiro256**
+ generators, one per stream, so that the rolls made by one part of the game
+ never shift the rolls made by another.
  * @version 1.0
  * @date 2022-05-27
  * 
@@ -12,14 +14,49 @@
 #include <stdlib.h>
 #include <time.h>
 
-/* Seed the random number generator with a given value. */
+#include "random.h"
+
+uint64_t rotl(uint64_t, int);
+uint64_t splitmix64(uint64_t *);
+uint64_t xoshiro_next(uint64_t *);
+uint64_t rnd_next(int);
+uint64_t rnd_below(int, uint64_t);
+
+/* The seed the game was started with, every stream's state, and how many
+   numbers have been drawn in total. Together they pin down the generators,
+   so a save can restore them exactly. */
+static uint64_t rng_seed = 0;
+static uint64_t rng_state[RNG_MAX][4];
+static unsigned long rng_draws = 0;
+
+uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/**
+ * @brief Step a splitmix64 generator. Used to spread a seed out over the
+ state of the xoshiro generators, which must not be all zeroes.
+ * 
+ * @param x The splitmix64 state.
+ * @return uint64_t The next output.
+ */
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
 /**
  * @brief Seed the random number generator with a given value
  * 
  * @param x The integer with which to seed the random number generator.
  */
-void rndseed(int x) {
-    srand(x);
+void rndseed(uint64_t x) {
+    rng_seed = x;
+    rng_draws = 0;
+    for (int i = 0; i < RNG_MAX; i++)
+        rnd_stream_seed(i, 0);
     return;
 }
 
@@ -29,52 +66,196 @@ void rndseed(int x) {
  * 
  */
 void rndseed_t() {
-    rndseed((unsigned) time(NULL));
+    rndseed((uint64_t) time(NULL));
     return;
 }
 
+/**
+ * @brief Reseed a single stream from the game's seed and a key, leaving the
+ other streams untouched. A stream seeded with the same game seed and key
+ always produces the same numbers.
+ * 
+ * @param stream The stream to reseed.
+ * @param key Distinguishes this seeding from others of the same stream.
+ */
+void rnd_stream_seed(int stream, uint64_t key) {
+    uint64_t x = rng_seed ^ splitmix64(&key) ^ ((uint64_t) stream << 56);
+
+    for (int i = 0; i < 4; i++)
+        rng_state[stream][i] = splitmix64(&x);
+}
+
+/**
+ * @brief Step a xoshiro256** generator.
+ * 
+ * @param s The generator's state.
+ * @return uint64_t The next output.
+ */
+uint64_t xoshiro_next(uint64_t *s) {
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/**
+ * @brief Draw 64 random bits from a stream with xoshiro256**.
+ * 
+ * @param stream The stream to draw from.
+ * @return uint64_t The bits drawn.
+ */
+uint64_t rnd_next(int stream) {
+    rng_draws++;
+    return xoshiro_next(rng_state[stream]);
+}
+
+/**
+ * @brief Seed generators of their own from a single draw of a stream. Each
+ one produces different numbers, but the same ones every time the stream is
+ in the same state, and drawing from them leaves the streams untouched, so
+ they can be handed to other threads.
+ * 
+ * @param stream The stream to draw the seed from.
+ * @param rngs The generators to seed.
+ * @param count How many generators there are.
+ */
+void rnd_fork(int stream, struct rng *rngs, int count) {
+    uint64_t x = rnd_next(stream);
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 4; j++)
+            rngs[i].s[j] = splitmix64(&x);
+    }
+}
+
+/**
+ * @brief Draw a number that is at least zero and less than a bound, without
+ the bias toward small numbers that taking a plain modulo has. Draws that
+ fall into the incomplete span at the bottom of the range are thrown away.
+ * 
+ * @param stream The stream to draw from.
+ * @param bound The bound. Must not be zero.
+ * @return uint64_t The number drawn.
+ */
+uint64_t rnd_below(int stream, uint64_t bound) {
+    uint64_t threshold = -bound % bound;
+    uint64_t x;
+
+    do {
+        x = rnd_next(stream);
+    } while (x < threshold);
+    return x % bound;
+}
+
+/**
+ * @brief Draw a number between zero and RND_MAX, for code that scales the
+ number itself.
+ * 
+ * @param stream The stream to draw from.
+ * @return int The number drawn.
+ */
+int rnd_raw(int stream) {
+    return rnd_next(stream) >> 33;
+}
+
+/**
+ * @brief Draw a number between zero and RND_MAX from a generator of its own.
+ * 
+ * @param rng The generator to draw from.
+ * @return int The number drawn.
+ */
+int rnd_raw_from(struct rng *rng) {
+    return xoshiro_next(rng->s) >> 33;
+}
+
+uint64_t rnd_seed(void) {
+    return rng_seed;
+}
+
+unsigned long rnd_draws(void) {
+    return rng_draws;
+}
+
+/**
+ * @brief Copy out the state of every stream, for saving.
+ * 
+ * @param state Where to copy the state to.
+ */
+void rnd_get_state(uint64_t state[RNG_MAX][4]) {
+    for (int i = 0; i < RNG_MAX; i++) {
+        for (int j = 0; j < 4; j++)
+            state[i][j] = rng_state[i][j];
+    }
+}
+
+/**
+ * @brief Put the generators back into a saved state.
+ * 
+ * @param seed The seed the game was started with.
+ * @param draws The number of draws made since seeding.
+ * @param state The state of every stream.
+ */
+void rnd_set_state(uint64_t seed, unsigned long draws, uint64_t state[RNG_MAX][4]) {
+    rng_seed = seed;
+    rng_draws = draws;
+    for (int i = 0; i < RNG_MAX; i++) {
+        for (int j = 0; j < 4; j++)
+            rng_state[i][j] = state[i][j];
+    }
+}
+
 /**
  * @brief Return a random number greater than or equal to zero and less than x.
  * 
+ * @param stream The stream to draw from.
  * @param x An upper bound.
  * @return int An integer greater than or equal to zero and less than x.
  */
-int rndmx(int x) {
-    return (rand() % x);
+int rndmx(int stream, int x) {
+    return rnd_below(stream, x);
 }
 
 /**
  * @brief Returns a random number greater than or equal to x and less than y.
  * 
+ * @param stream The stream to draw from.
  * @param x A lower bound.
  * @param y An upper bound.
  * @return int An integer greater than or equal to x and less than y.
  */
-int rndrng(int x, int y) {
+int rndrng(int stream, int x, int y) {
     if (y <= x) return x;
-    return (x + (rand() % abs(y - x)));
+    return x + (int) rnd_below(stream, (unsigned) (y - x));
 }
 
 /**
  * @brief Returns a random boolean falue.
  * 
+ * @param stream The stream to draw from.
  * @return int A boolean value; either zero or one.
  */
-int rndbool() {
-    return (rand() % 2);
+int rndbool(int stream) {
+    return rnd_next(stream) >> 63;
 }
 
 /**
  * @brief Roll xdy and return the result.
  * 
+ * @param stream The stream to draw from.
  * @param x The number of dice to roll.
  * @param y The number of sides on said dice.
  * @return int The result of the dice roll.
  */
-int d(int x, int y) {
+int d(int stream, int x, int y) {
     int ret = 0;
     for (int i = 0; i < x; i++) {
-        ret += rndrng(1, y + 1);
+        ret += rndrng(stream, 1, y + 1);
     }
     return ret;
-}
\ No newline at end of file
+}
@@ -10,9 +10,13 @@
  */
 
 #include "register.h"
+#include "windows.h"
 
 struct global g = {0};
 
+/* The active windowport. Set up in main(). */
+struct window_procs windowprocs;
+
 struct bitflags f = {
     .update_msg = 1,
     .update_map = 1,
@@ -26,7 +30,8 @@ struct bitflags f = {
 struct terminal term = {
     .h = 40,
     .w = 90,
-    .hudmode = 0
+    .hudmode = 0,
+    .max_fps = 30
 };
 
 /**
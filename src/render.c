@@ -10,6 +10,7 @@
  */
 
 #include <stdlib.h>
+#include <time.h>
 
 #include "map.h"
 #include "register.h"
@@ -20,8 +21,24 @@
 #include "action.h"
 
 int update_camera(void);
-void put_heatmap(int, int);
+void scroll_camera(int, int);
+void cell_glyph(int, int, struct glyph *);
+void heatmap_glyph(int, int, struct glyph *);
 void render_cursor(void);
+int frame_due(void);
+
+/* The set of map cells that need to be redrawn, kept as one half-open span
+   [x1, x2) of dirty columns per map row, plus the range of rows that hold
+   any span at all. A row is clean when x1 >= x2. */
+static int dirty_x1[MAPH];
+static int dirty_x2[MAPH];
+static int dirty_y1 = MAPH;
+static int dirty_y2 = -1;
+/* Map coordinates of the last actor drawn as the target. */
+static int target_x = -1;
+static int target_y = -1;
+/* Time at which the last frame was drawn. */
+static struct timespec last_frame;
 
 
 /**
@@ -34,13 +51,16 @@ void render_all(void) {
         calculate_fov(g.player->x, g.player->y, 7);
     }
 
-    /* Do not continually render when auto-exploring. Comes after fov updates
-       since fov updates potentially affect the game state. */
-    if (f.mode_explore) {
-        f.update_map = 0;
+    /* Limit the frame rate when running, traveling or auto-exploring. Comes
+       after fov updates since fov updates potentially affect the game state.
+       Anything marked for redrawing carries over to the next frame, and
+       stop_running() draws the final frame as soon as the run ends. */
+    if ((f.mode_explore || f.mode_run) && !frame_due())
         return;
-    }
-    
+    if (!windowprocs.has_display)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+
     render_map();
     render_all_actors();
     if (f.mode_look) {
@@ -52,8 +72,24 @@ void render_all(void) {
     if (f.update_msg) {
         draw_msg_window(0);
     }
-    update_panels();
-    doupdate();
+    flush_screen();
+}
+
+/**
+ * @brief Determine whether enough time has passed since the last frame to
+ draw another one without exceeding term.max_fps.
+ * 
+ * @return int 1 if a frame should be drawn, 0 otherwise.
+ */
+int frame_due(void) {
+    struct timespec now;
+    long elapsed;
+
+    if (term.max_fps <= 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - last_frame.tv_sec) * 1000000000L + (now.tv_nsec - last_frame.tv_nsec);
+    return elapsed >= 1000000000L / term.max_fps;
 }
 
 /**
@@ -82,9 +118,76 @@ int update_camera(void) {
     
     if (px == g.cx && py == g.cy)
         return 0;
+    scroll_camera(g.cx - px, g.cy - py);
     return 1;
 }
 
+/**
+ * @brief Shift the contents of the map window to follow a camera movement,
+ and mark the strips of the map that have scrolled into view. If the camera
+ moved a full screen or more, the whole viewport is marked instead.
+ * 
+ * @param dx Change in the x coordinate of the camera.
+ * @param dy Change in the y coordinate of the camera.
+ */
+void scroll_camera(int dx, int dy) {
+    if (f.update_map)
+        return;
+    if (abs(dx) >= term.mapwin_w || abs(dy) >= term.mapwin_h) {
+        f.update_map = 1;
+        return;
+    }
+    scroll_map(dx, dy);
+    if (dx > 0)
+        mark_refresh_rect(g.cx + term.mapwin_w - dx, g.cy, g.cx + term.mapwin_w - 1, g.cy + term.mapwin_h - 1);
+    else if (dx < 0)
+        mark_refresh_rect(g.cx, g.cy, g.cx - dx - 1, g.cy + term.mapwin_h - 1);
+    if (dy > 0)
+        mark_refresh_rect(g.cx, g.cy + term.mapwin_h - dy, g.cx + term.mapwin_w - 1, g.cy + term.mapwin_h - 1);
+    else if (dy < 0)
+        mark_refresh_rect(g.cx, g.cy, g.cx + term.mapwin_w - 1, g.cy - dy - 1);
+}
+
+/**
+ * @brief Mark a single cell as needing to be redrawn.
+ * 
+ * @param x The x coordinate of the cell.
+ * @param y The y coordinate of the cell.
+ */
+void mark_refresh(int x, int y) {
+    if (!in_bounds(x, y))
+        return;
+    if (dirty_x1[y] >= dirty_x2[y]) {
+        dirty_x1[y] = x;
+        dirty_x2[y] = x + 1;
+    } else {
+        dirty_x1[y] = min(dirty_x1[y], x);
+        dirty_x2[y] = max(dirty_x2[y], x + 1);
+    }
+    dirty_y1 = min(dirty_y1, y);
+    dirty_y2 = max(dirty_y2, y);
+}
+
+/**
+ * @brief Mark a rectangle of cells as needing to be redrawn. The rectangle
+ is clipped to the bounds of the map.
+ * 
+ * @param x1 The x coordinate of the top left corner.
+ * @param y1 The y coordinate of the top left corner.
+ * @param x2 The x coordinate of the bottom right corner.
+ * @param y2 The y coordinate of the bottom right corner.
+ */
+void mark_refresh_rect(int x1, int y1, int x2, int y2) {
+    x1 = max(x1, 0);
+    y1 = max(y1, 0);
+    x2 = min(x2, MAPW - 1);
+    y2 = min(y2, MAPH - 1);
+    for (int y = y1; y <= y2 && x1 <= x2; y++) {
+        mark_refresh(x1, y);
+        mark_refresh(x2, y);
+    }
+}
+
 /**
  * @brief Re-render a single cell.
  * 
@@ -103,31 +206,57 @@ void refresh_cell(int x, int y) {
 }
 
 /**
- * @brief Render the map, tile by tile.
- Loops over the entirety of the map, and works in O(n) time.
+ * @brief Get the glyph used to draw the terrain of a single map cell.
+ * 
+ * @param x The x coordinate of the cell.
+ * @param y The y coordinate of the cell.
+ * @param glyph The glyph to fill out. Mutated by this function.
+ */
+void cell_glyph(int x, int y, struct glyph *glyph) {
+    if (is_explored(x, y)) {
+        if (g.display_heat) {
+            heatmap_glyph(x, y, glyph);
+        } else {
+            glyph->chr = g.levmap[x][y].pt->chr;
+            glyph->color = is_visible(x, y) ? g.levmap[x][y].color : DARK_GRAY;
+        }
+    } else {
+        glyph->chr = ' ';
+        glyph->color = WHITE;
+    }
+}
+
+/**
+ * @brief Render the map. Only the cells marked with mark_refresh() are
+ redrawn, unless f.update_map requests a repaint of the whole viewport.
+ Each dirty span is written out as a single row of glyphs.
  * 
  */
 void render_map(void) {
-    int refresh_all;
-
-    refresh_all = update_camera();
-    for (int i = 0; i < term.mapwin_w; i++) {
-        for (int j = 0; j < term.mapwin_h; j++) {
-            if (in_bounds(i + g.cx, j + g.cy)
-                && (needs_refresh(i + g.cx, j + g.cy) || refresh_all)) {
-                if (is_explored(i + g.cx, j + g.cy)) {
-                    if (g.display_heat)
-                        put_heatmap(i, j);
-                    else
-                        map_put_tile(i, j, i + g.cx, j + g.cy, 
-                            is_visible(i + g.cx, j + g.cy) ? g.levmap[i + g.cx][j + g.cy].color : DARK_GRAY);
-                } else {
-                    map_putch(i, j, ' ', WHITE);
-                }
-                g.levmap[i + g.cx][j + g.cy].refresh = 0;
-            }
+    struct glyph row[MAPW];
+    int x1, x2;
+
+    update_camera();
+    /* Heatmaps change every turn, so redraw them in full. */
+    if (f.update_map || g.display_heat)
+        mark_refresh_rect(g.cx, g.cy, g.cx + term.mapwin_w - 1, g.cy + term.mapwin_h - 1);
+    for (int y = max(dirty_y1, g.cy); y <= min(dirty_y2, g.cy + term.mapwin_h - 1); y++) {
+        x1 = max(dirty_x1[y], g.cx);
+        x2 = min(dirty_x2[y], g.cx + term.mapwin_w);
+        for (int x = x1; x < x2; x++) {
+            cell_glyph(x, y, &row[x - x1]);
         }
+        if (x1 < x2)
+            map_put_row(x1 - g.cx, y - g.cy, row, x2 - x1);
     }
+    /* Anything marked outside of the viewport is dropped. It will be drawn
+       as part of an exposed strip if the camera moves to it. */
+    for (int y = dirty_y1; y <= dirty_y2; y++) {
+        dirty_x1[y] = 0;
+        dirty_x2[y] = 0;
+    }
+    dirty_y1 = MAPH;
+    dirty_y2 = -1;
     f.update_map = 0;
     return;
 }
@@ -138,6 +267,13 @@ void render_map(void) {
  */
 void render_all_actors(void) {
     struct actor *cur = g.player;
+
+    /* Redraw the cell of the previous target on the next frame, so that its
+       underline goes away if the target changes. */
+    if (target_x >= 0)
+        mark_refresh(target_x, target_y);
+    target_x = g.target ? g.target->x : -1;
+    target_y = g.target ? g.target->y : -1;
     while (cur != NULL) {
         if (is_visible(cur->x, cur->y)) {
             if (cur->item && !MON_AT(cur->x, cur->y))
@@ -170,23 +306,27 @@ void clear_actors(void) {
 static const char hm_chars[MAX_HEATMAP_DISPLAY] = "?123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
 /**
- * @brief Display a heatmap on the main map. For debug purposes only.
+ * @brief Get the glyph used to display a heatmap on the main map. For debug
+ purposes only.
  * 
  * @param x x coordinate of the map.
  * @param y y coordinate of the map.
+ * @param glyph The glyph to fill out. Mutated by this function.
  */
-void put_heatmap(int x, int y) {
-    int i = g.heatmap[g.display_heat - 1][x + g.cx][y + g.cy];
+void heatmap_glyph(int x, int y, struct glyph *glyph) {
+    int i = g.heatmap[g.display_heat - 1][x][y];
+    glyph->color = WHITE;
     if (i == IMPASSABLE) {
-        map_putch(x, y, ' ', WHITE);
+        glyph->chr = ' ';
         return;
     } else if (!i) {
-        map_putch(x, y, '.', WHITE);
+        glyph->chr = '.';
         return;
     }
     i = i % MAX_HEATMAP_DISPLAY;
-    int color = 0xffffff - i * (0xffffff / MAX_HEATMAP_DISPLAY);
-    map_putch_truecolor(x, y, hm_chars[i], color);
+    glyph->chr = hm_chars[i];
+    /* Curses only supports a small set of colors, so reduce modulo. */
+    glyph->color = (0xffffff - i * (0xffffff / MAX_HEATMAP_DISPLAY)) % MAX_COLOR;
 }
 
 /**
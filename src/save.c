@@ -12,6 +12,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "message.h"
 #include "register.h"
@@ -19,13 +26,83 @@
 #include "ai.h"
 #include "invent.h"
 #include "actor.h"
+#include "action.h"
+#include "map.h"
+#include "mapgen.h"
 #include "windows.h"
+#include "random.h"
+#include "journal.h"
 
-void save_actor(FILE *, struct actor *);
+void encode_levmap(struct save_buf *);
+void decode_levmap(struct save_buf *);
+void *pool_take(int);
 void reset_saved_flags(void);
-void reset_saved_actor(struct actor *);
-struct actor *load_actor(FILE *, struct actor *);
 void load_active_attacker(void);
+void save_filename(char *, size_t);
+void *save_writer(void *);
+void reap_autosave(int);
+int saving_disabled(void);
+
+/* A snapshot being written out by the background writer. */
+struct save_job {
+    char fname[MAX_USERSZ + 4];
+    struct save_buf buf;
+    unsigned long journal_seq; /* First journal record the save leaves out. */
+    int failed;
+};
+
+static pthread_t writer_thread;
+static struct save_job *pending_job = NULL;
+
+/* Autosave settings and the pid of the autosave child, if one is running. */
+static int autosave_interval = 100;
+static int last_autosave = -1;
+static pid_t autosave_pid = 0;
+static unsigned long autosave_seq = 0;
+
+/* Set in the autosave child. It must never panik() or exit(), since that
+   would tear down the parent's screen and run the parent's atexit
+   handlers, so failures there _exit() instead and the parent reports
+   them when it reaps the child. */
+static int in_autosave_child = 0;
+
+/* Save file layout. All multi-byte values are little-endian. Integers past
+   the header are LEB128 varints, with signed values zigzag-encoded first. */
+static const unsigned char save_magic[4] = { 'Z', 'Z', 'S', 'V' };
+#define SAVE_HEADER_SIZE (8 + 4 * POOL_MAX)
+
+/* The header records how many actors and components of each kind the save
+   holds, so that the loader can carve them all out of a single block. */
+static const size_t pool_sizes[POOL_MAX] = {
+    sizeof(struct actor),
+    sizeof(struct name),
+    sizeof(struct ai),
+    sizeof(struct item),
+    sizeof(struct equip)
+};
+
+/* The block that loaded actors live in. Each kind gets its own run of the
+   block, handed out in order as records are decoded. */
+static struct {
+    unsigned char *block;
+    unsigned char *next[POOL_MAX];
+    unsigned long left[POOL_MAX];
+    int borrowed; /* The block belongs to someone else. */
+} actor_pool;
+
+/* Actor record component flags. */
+#define AC_NAME     0x01
+#define AC_AI       0x02
+#define AC_EQUIP    0x04
+#define AC_INVENT   0x08
+#define AC_ITEM     0x10
+#define AC_UNIQUE   0x20
+#define AC_CAN_TECH 0x40
+
+/* Levmap tile byte. The permtile id takes the upper six bits. */
+#define TB_EXPLORED 0x01
+#define TB_LIT      0x02
+#define TB_ID_SHIFT 2
 
 /**
  * @brief Save the game and immediately exit.
@@ -54,111 +131,589 @@ int file_exists(const char *fname) {
     return 1;
 }
 
+/* BUFFER FUNCTIONS */
+
+/**
+ * @brief Append raw bytes to a save buffer, growing it as needed.
+ * 
+ * @param buf The buffer to write to.
+ * @param data The bytes to write.
+ * @param len The number of bytes to write.
+ */
+void put_bytes(struct save_buf *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        buf->cap = max(buf->cap * 2, buf->len + len + 256);
+        buf->data = realloc(buf->data, buf->cap);
+        if (buf->data == NULL && in_autosave_child)
+            _exit(1);
+        if (buf->data == NULL)
+            panik("Ran out of memory while saving.");
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+void put_byte(struct save_buf *buf, unsigned char byte) {
+    put_bytes(buf, &byte, 1);
+}
+
+/**
+ * @brief Write an unsigned integer as a LEB128 varint.
+ * 
+ * @param buf The buffer to write to.
+ * @param val The value to write.
+ */
+void put_uvar(struct save_buf *buf, unsigned long val) {
+    while (val >= 0x80) {
+        put_byte(buf, (val & 0x7f) | 0x80);
+        val >>= 7;
+    }
+    put_byte(buf, val);
+}
+
+/**
+ * @brief Write a signed integer as a zigzag-encoded varint, so that small
+ negative numbers stay small.
+ * 
+ * @param buf The buffer to write to.
+ * @param val The value to write.
+ */
+void put_svar(struct save_buf *buf, long val) {
+    put_uvar(buf, ((unsigned long) val << 1) ^ (unsigned long) (val < 0 ? -1L : 0L));
+}
+
+/**
+ * @brief Write a length-prefixed string.
+ * 
+ * @param buf The buffer to write to.
+ * @param str The string to write.
+ */
+void put_str(struct save_buf *buf, const char *str) {
+    size_t len = strlen(str);
+    put_uvar(buf, len);
+    put_bytes(buf, str, len);
+}
+
+/**
+ * @brief Read a byte from a save buffer. Reading past the end of the buffer
+ sets the error flag and returns zero.
+ * 
+ * @param buf The buffer to read from.
+ * @return unsigned char The byte read.
+ */
+unsigned char get_byte(struct save_buf *buf) {
+    if (buf->pos >= buf->len) {
+        buf->error = 1;
+        return 0;
+    }
+    return buf->data[buf->pos++];
+}
+
+unsigned long get_uvar(struct save_buf *buf) {
+    unsigned long val = 0;
+    unsigned char byte;
+    int shift = 0;
+
+    do {
+        byte = get_byte(buf);
+        if (shift < (int) sizeof(unsigned long) * 8)
+            val |= (unsigned long) (byte & 0x7f) << shift;
+        shift += 7;
+    } while ((byte & 0x80) && !buf->error);
+    return val;
+}
+
+long get_svar(struct save_buf *buf) {
+    unsigned long val = get_uvar(buf);
+    return (long) (val >> 1) ^ -(long) (val & 1);
+}
+
+/**
+ * @brief Read a length-prefixed string. Strings too long for the destination
+ are truncated.
+ * 
+ * @param buf The buffer to read from.
+ * @param str The destination.
+ * @param size The size of the destination.
+ */
+void get_str(struct save_buf *buf, char *str, size_t size) {
+    size_t len = get_uvar(buf);
+    if (len > buf->len - buf->pos) {
+        buf->error = 1;
+        str[0] = '\0';
+        return;
+    }
+    memcpy(str, buf->data + buf->pos, min(len, size - 1));
+    str[min(len, size - 1)] = '\0';
+    buf->pos += len;
+}
+
+/* SAVING */
+
+/**
+ * @brief Build the name of the save file for the current team.
+ * 
+ * @param fname The buffer to write the name to.
+ * @param size The size of the buffer.
+ */
+void save_filename(char *fname, size_t size) {
+    snprintf(fname, size, "%s.sav", g.userbuf);
+}
+
+/**
+ * @brief Atomically replace a save file. The data is written to a temporary
+ file, flushed to disk, and then renamed over the old save, so a crash part
+ way through never leaves a truncated save behind. Does not touch any game
+ state, so it is safe to call from the background writer.
+ * 
+ * @param fname The save file to replace.
+ * @param buf The serialized game.
+ * @return int 0 on success, 1 on failure.
+ */
+int write_save_file(const char *fname, const struct save_buf *buf) {
+    char tmpname[MAX_USERSZ + 24];
+    size_t written = 0;
+    ssize_t ret;
+    int fd;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", fname, (int) getpid());
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 1;
+    while (written < buf->len) {
+        ret = write(fd, buf->data + written, buf->len - written);
+        if (ret < 0) {
+            close(fd);
+            unlink(tmpname);
+            return 1;
+        }
+        written += ret;
+    }
+    if (fsync(fd) || close(fd) || rename(tmpname, fname)) {
+        unlink(tmpname);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Entry point of the background writer thread.
+ * 
+ * @param arg The save job to write.
+ * @return void* Unused.
+ */
+void *save_writer(void *arg) {
+    struct save_job *job = arg;
+    job->failed = write_save_file(job->fname, &job->buf);
+    return NULL;
+}
+
+/**
+ * @brief Wait for the background writer to finish the save it is working
+ on, if any. Must be called before the save file is touched again, and
+ before the program exits.
+ * 
+ */
+void finish_saving(void) {
+    reap_autosave(1);
+    if (pending_job == NULL)
+        return;
+    pthread_join(writer_thread, NULL);
+    if (pending_job->failed)
+        logm_warning("Could not write save file %s.", pending_job->fname);
+    else
+        journal_compact(pending_job->journal_seq);
+    free(pending_job->buf.data);
+    free(pending_job);
+    pending_job = NULL;
+}
+
+/**
+ * @brief Collect the autosave child once it has exited.
+ * 
+ * @param block Whether to wait for the child to finish.
+ */
+void reap_autosave(int block) {
+    int status;
+    pid_t ret;
+
+    if (autosave_pid <= 0)
+        return;
+    ret = waitpid(autosave_pid, &status, block ? 0 : WNOHANG);
+    if (ret == 0)
+        return;
+    if (ret > 0 && (!WIFEXITED(status) || WEXITSTATUS(status)))
+        logm_warning("Autosave failed.");
+    else if (ret > 0)
+        journal_compact(autosave_seq);
+    autosave_pid = 0;
+}
+
+/**
+ * @brief Set how often the game autosaves.
+ * 
+ * @param turns Number of turns between autosaves. 0 disables autosaving.
+ */
+void set_autosave_interval(int turns) {
+    autosave_interval = max(0, turns);
+}
+
+/**
+ * @brief Autosave if enough turns have passed since the last autosave. The
+ process forks, and the child serializes its copy-on-write image of the game
+ and writes it out while the parent carries on. Like a manual save, must be
+ called at the start of the player's turn, once its regular values have been
+ incremented: a loaded game sets resume_turn and picks up from there, so
+ increment_regular_values() is skipped for that turn.
+ * 
+ */
+void autosave(void) {
+    struct save_buf buf = { 0 };
+    char fname[MAX_USERSZ + 4];
+    pid_t pid;
+
+    reap_autosave(0);
+    /* The game being recovered from the journal was already saved the
+       first time around. */
+    if (journal_replaying())
+        return;
+    /* Count from the first turn seen rather than using the turn number
+       itself, since the player can sleep through the exact turn. */
+    if (last_autosave < 0)
+        last_autosave = g.turns;
+    if (!autosave_interval || g.turns - last_autosave < autosave_interval)
+        return;
+    /* Skip this autosave if the last one is somehow still running. */
+    if (autosave_pid > 0)
+        return;
+    /* Don't let the child race the background writer to the save file. */
+    finish_saving();
+    last_autosave = g.turns;
+    autosave_seq = journal_seq();
+
+    pid = fork();
+    if (pid == 0) {
+        /* Child. Exit without running atexit handlers, which would tear
+           down the parent's screen. */
+        in_autosave_child = 1;
+        save_filename(fname, sizeof(fname));
+        encode_game(&buf);
+        _exit(write_save_file(fname, &buf));
+    } else if (pid < 0) {
+        logm_warning("Autosave failed: could not fork.");
+        return;
+    }
+    autosave_pid = pid;
+}
+
+/**
+ * @brief Check whether the team's save and journal must be left alone,
+ which they are while a journal is replayed on its own with --replay.
+ * 
+ * @return int 1 if nothing may be saved or deleted, 0 otherwise.
+ */
+int saving_disabled(void) {
+    return journal_replay_only();
+}
+
+/**
+ * @brief Delete the save file once the game is over, so that a finished
+ game cannot be resumed from an autosave or staircase save.
+ * 
+ */
+void delete_save(void) {
+    char fname[MAX_USERSZ + 4];
+
+    if (saving_disabled())
+        return;
+    finish_saving();
+    save_filename(fname, sizeof(fname));
+    remove(fname);
+    journal_delete();
+}
+
 /**
  * @brief Save the current gamestate to a file.
  * 
  */
 void save_game(void) {
     char fname[MAX_USERSZ + 4];
-    FILE *fp;
+    struct save_buf buf = { 0 };
 
-    struct actor *cur_actor = g.player;
-    int actor_count = 0;
+    if (saving_disabled())
+        return;
+    finish_saving();
+    save_filename(fname, sizeof(fname));
+    encode_game(&buf);
+    if (write_save_file(fname, &buf))
+        logm_warning("Could not write save file %s.", fname);
+    else
+        journal_compact(journal_seq());
+    free(buf.data);
+}
 
-    snprintf(fname, sizeof(fname), "%s.sav", g.userbuf);
-    fp = fopen(fname, "w");
-    if (!fp) {
-        logm_warning("Could not open save file %d.", fname);
+/**
+ * @brief Save the current gamestate without waiting for the disk. The game
+ is serialized into a snapshot on this thread, and the snapshot is written
+ out by a background thread. Falls back to saving synchronously if the
+ job cannot be allocated or the thread cannot be started.
+ * 
+ */
+void save_game_async(void) {
+    struct save_job *job;
+
+    if (saving_disabled())
+        return;
+    finish_saving();
+    job = malloc(sizeof(struct save_job));
+    if (job == NULL) {
+        save_game();
+        return;
+    }
+    *job = (struct save_job) { 0 };
+    save_filename(job->fname, sizeof(job->fname));
+    encode_game(&job->buf);
+    job->journal_seq = journal_seq();
+    if (pthread_create(&writer_thread, NULL, save_writer, job)) {
+        if (write_save_file(job->fname, &job->buf))
+            logm_warning("Could not write save file %s.", job->fname);
+        else
+            journal_compact(job->journal_seq);
+        free(job->buf.data);
+        free(job);
         return;
     }
+    pending_job = job;
+}
 
-    /* This is a bit of a kludge. Essentially, we have to roll back the current
-       turn a bit, so that when the game starts up again the player does not
-       lose a turn or get a free turn. If we change the main loop logic at some
-       point, we can change this as well. */
-    g.player->energy -= 100;
-    g.turns -= 1;
+/**
+ * @brief Serialize the current gamestate into a buffer.
+ * 
+ * @param buf The buffer to write to. Should be zero-initialized, and must
+ be freed by the caller.
+ */
+void encode_game(struct save_buf *buf) {
+    struct actor *cur_actor;
+    unsigned char header[SAVE_HEADER_SIZE];
+    unsigned long counts[POOL_MAX] = { 0 };
+    uint64_t rng_state[RNG_MAX][4];
+    int actor_count = 0;
 
-    /* Write the global struct. */
-    (void) fwrite(&g, sizeof(struct global), 1, fp);
-    /* Write level map */
-    for (int y = 0; y < MAPH; y++) {
-        for (int x = 0; x < MAPW; x++) {
-            (void) fwrite(&(g.levmap[x][y].pt->id), sizeof(int), 1, fp);
-        }
+    for (int i = 0; i < g.total_monsters; i++)
+        count_actor(g.monsters[i], counts);
+    for (int i = 0; i < g.total_items; i++)
+        count_actor(g.items[i], counts);
+    for (cur_actor = g.player; cur_actor != NULL; cur_actor = cur_actor->next)
+        count_actor(cur_actor, counts);
+
+    memcpy(header, save_magic, sizeof(save_magic));
+    header[4] = SAVE_VERSION & 0xff;
+    header[5] = (SAVE_VERSION >> 8) & 0xff;
+    header[6] = 0;
+    header[7] = 0;
+    for (int i = 0; i < POOL_MAX; i++) {
+        for (int j = 0; j < 4; j++)
+            header[8 + i * 4 + j] = (counts[i] >> (j * 8)) & 0xff;
     }
+    put_bytes(buf, header, SAVE_HEADER_SIZE);
+
+    /* Write the globals that cannot be derived on load. Saves are made at
+       the start of one of the player's actions, and the game resumes from
+       that exact point, so that replaying the journal on top of a save
+       reproduces the game. */
+    put_str(buf, g.userbuf);
+    put_svar(buf, g.prev_action ? g.prev_action->index : -1);
+    put_uvar(buf, g.active_attack_index);
+    put_uvar(buf, g.display_heat);
+    put_svar(buf, g.turns);
+    put_svar(buf, g.depth);
+    put_svar(buf, g.max_depth);
+    put_svar(buf, g.score);
+    put_svar(buf, g.spawn_countdown);
+    put_svar(buf, g.up_x);
+    put_svar(buf, g.up_y);
+    put_svar(buf, g.down_x);
+    put_svar(buf, g.down_y);
+    put_svar(buf, g.cx);
+    put_svar(buf, g.cy);
+    put_svar(buf, g.cursor_x);
+    put_svar(buf, g.cursor_y);
+    put_svar(buf, g.goal_x);
+    put_svar(buf, g.goal_y);
+    put_uvar(buf, g.debug | (g.practice << 1) | (f.mode_explore << 2) | (f.mode_run << 3)
+                  | (get_mapgen() << 4));
+    put_uvar(buf, rnd_seed());
+    put_uvar(buf, rnd_draws());
+    rnd_get_state(rng_state);
+    for (int i = 0; i < RNG_MAX; i++) {
+        for (int j = 0; j < 4; j++)
+            put_uvar(buf, rng_state[i][j]);
+    }
+    put_uvar(buf, journal_seq());
+
+    encode_levmap(buf);
+
     /* Write the monster dictionary */
+    put_uvar(buf, g.total_monsters);
     for (int i = 0; i < g.total_monsters; i++) {
-        save_actor(fp, g.monsters[i]);
+        encode_actor(buf, g.monsters[i]);
     }
+    put_uvar(buf, g.total_items);
     for (int i = 0; i < g.total_items; i++) {
-        save_actor(fp, g.items[i]);
+        encode_actor(buf, g.items[i]);
     }
-    /* Count actors */
+    /* Write actors */
+    cur_actor = g.player;
     while (cur_actor != NULL) {
         actor_count++;
         cur_actor = cur_actor->next;
     }
-    (void) fwrite(&actor_count, sizeof(int), 1, fp);
-    /* Write actors */
+    put_uvar(buf, actor_count);
     cur_actor = g.player;
     while (cur_actor != NULL) {
-        save_actor(fp, cur_actor);
+        encode_actor(buf, cur_actor);
         cur_actor = cur_actor->next;
     }
-    fclose(fp);
     reset_saved_flags();
 }
 
 /**
- * @brief Save an actor struct to a file. Called recursively in
- order to save objects contained in the inventory of an actor.
+ * @brief Write the level map. Each tile is reduced to a single byte holding
+ its permtile id and its explored and lit flags, and the bytes are then
+ run-length encoded as (run length, byte) pairs.
  * 
- * @param fp The name of the file to save the actor to.
+ * @param buf The buffer to write to.
+ */
+void encode_levmap(struct save_buf *buf) {
+    unsigned char cur, prev = 0;
+    unsigned long run = 0;
+
+    for (int y = 0; y < MAPH; y++) {
+        for (int x = 0; x < MAPW; x++) {
+            cur = (g.levmap[x][y].pt->id << TB_ID_SHIFT)
+                  | (g.levmap[x][y].explored ? TB_EXPLORED : 0)
+                  | (g.levmap[x][y].lit ? TB_LIT : 0);
+            if (run && cur != prev) {
+                put_uvar(buf, run);
+                put_byte(buf, prev);
+                run = 0;
+            }
+            prev = cur;
+            run++;
+        }
+    }
+    put_uvar(buf, run);
+    put_byte(buf, prev);
+}
+
+/**
+ * @brief Write an actor record. Called recursively in order to save objects
+ contained in the inventory of an actor. Pointers are not written; equip
+ slots are rebuilt from the slot of each inventory item on load.
+ * 
+ * @param buf The buffer to write to.
  * @param actor The actor struct to be saved.
  */
-void save_actor(FILE *fp, struct actor *actor) {
-    int item_count;
-    struct actor *cur_item = actor->invent;
+void encode_actor(struct save_buf *buf, struct actor *actor) {
+    int item_count = 0;
+    unsigned long components = 0;
+    struct actor *cur_item;
 
     /* If some wires get crossed and we end up with an actor that
        refers to itself, immediately kill the process. We don't
-       want to fill the user's entire hard drive. */
-    if (actor->saved) {
-        fclose(fp);
-        exit(1);
+       want to fill all of the user's memory. Only an actor with an
+       inventory can lead back to itself, so the rest are left untouched,
+       which keeps the pages of a shared data image from being copied. */
+    if (actor->invent) {
+        if (actor->saved && in_autosave_child)
+            _exit(1);
+        if (actor->saved)
+            panik("Actor %d refers to itself. Aborting save.", actor->id);
+        actor->saved = 1;
+    }
+
+    if (actor->name) components |= AC_NAME;
+    if (actor->ai) components |= AC_AI;
+    if (actor->equip) components |= AC_EQUIP;
+    if (actor->invent) components |= AC_INVENT;
+    if (actor->item) components |= AC_ITEM;
+    if (actor->unique) components |= AC_UNIQUE;
+    if (actor->can_tech) components |= AC_CAN_TECH;
+    put_uvar(buf, components);
+
+    put_svar(buf, actor->id);
+    put_svar(buf, actor->chr);
+    put_byte(buf, actor->color);
+    put_byte(buf, actor->x);
+    put_byte(buf, actor->y);
+    put_byte(buf, actor->lv);
+    put_svar(buf, actor->energy);
+    put_svar(buf, actor->hp);
+    put_svar(buf, actor->hpmax);
+    put_svar(buf, actor->speed);
+    put_svar(buf, actor->evasion);
+    put_svar(buf, actor->accuracy);
+    put_svar(buf, actor->temp_evasion);
+    put_svar(buf, actor->temp_accuracy);
+    put_byte(buf, actor->combo_counter);
+    for (int i = 0; i < MAX_ATTK; i++) {
+        put_byte(buf, actor->attacks[i].dam);
+        put_byte(buf, actor->attacks[i].kb);
+        put_byte(buf, actor->attacks[i].accuracy);
+        put_byte(buf, actor->attacks[i].stun);
+        put_byte(buf, actor->attacks[i].recovery);
+        put_uvar(buf, actor->attacks[i].hitdescs);
     }
-    actor->saved = 1;
+    put_uvar(buf, actor->stance);
+    put_uvar(buf, actor->old_stance);
+    put_uvar(buf, actor->known);
 
-    /* Write the actor, then write each of the actor's components. */
-    (void) fwrite(actor, sizeof(struct actor), 1, fp);
     if (actor->name) {
-        (void) fwrite(actor->name, sizeof(struct name), 1, fp);
+        put_str(buf, actor->name->real_name);
+        put_str(buf, actor->name->appearance);
+        put_str(buf, actor->name->given_name);
     }
     if (actor->ai) {
-        (void) fwrite(actor->ai, sizeof(struct ai), 1, fp);
-    }
-    if (actor->equip) {
-        (void) fwrite(actor->equip, sizeof(struct equip), 1, fp);
+        put_svar(buf, actor->ai->seekdef);
+        put_svar(buf, actor->ai->seekcur);
+        put_uvar(buf, actor->ai->faction);
+        put_uvar(buf, actor->ai->guardian);
     }
     if (actor->invent) {
-        cur_item = actor->invent;
-        while (cur_item != NULL) {
-            cur_item = cur_item->next;
+        for (cur_item = actor->invent; cur_item != NULL; cur_item = cur_item->next) {
             item_count++;
         }
-        (void) fwrite(&item_count, sizeof(int), 1, fp);
-        cur_item = actor->invent;
-        while (cur_item != NULL) {
-            save_actor(fp, cur_item);
-            cur_item = cur_item->next;
+        put_uvar(buf, item_count);
+        for (cur_item = actor->invent; cur_item != NULL; cur_item = cur_item->next) {
+            encode_actor(buf, cur_item);
         }
     }
     if (actor->item) {
-        (void) fwrite(actor->item, sizeof(struct item), 1, fp);
+        put_svar(buf, actor->item->slot);
+        put_svar(buf, actor->item->pref_slot);
+        put_svar(buf, actor->item->poss_slot);
+        put_svar(buf, actor->item->quan);
+        put_svar(buf, actor->item->letter);
     }
 }
 
+/**
+ * @brief Tally an actor and its components, including everything in its
+ inventory, for the save header.
+ * 
+ * @param actor The actor to count.
+ * @param counts The tally for each kind of pooled allocation.
+ */
+void count_actor(struct actor *actor, unsigned long *counts) {
+    counts[POOL_ACTOR]++;
+    if (actor->name) counts[POOL_NAME]++;
+    if (actor->ai) counts[POOL_AI]++;
+    if (actor->item) counts[POOL_ITEM]++;
+    if (actor->equip) counts[POOL_EQUIP]++;
+    for (struct actor *cur = actor->invent; cur != NULL; cur = cur->next)
+        count_actor(cur, counts);
+}
+
 /**
  * @brief Reset the saved field of all actors
 tracked by the global struct.
@@ -167,10 +722,10 @@ tracked by the global struct.
 void reset_saved_flags(void) {
     struct actor *cur_actor = g.player;
     for (int i = 0; i < g.total_monsters; i++) {
-        g.monsters[i]->saved = 0;
+        reset_saved_actor(g.monsters[i]);
     }
     for (int i = 0; i < g.total_items; i++) {
-        g.items[i]->saved = 0;
+        reset_saved_actor(g.items[i]);
     }
     while (cur_actor != NULL) {
         reset_saved_actor(cur_actor);
@@ -186,7 +741,8 @@ void reset_saved_flags(void) {
 void reset_saved_actor(struct actor *actor) {
     struct actor *cur_item;
 
-    actor->saved = 0;
+    if (actor->saved)
+        actor->saved = 0;
     if (actor->invent) {
         cur_item = actor->invent;
         while (cur_item != NULL) {
@@ -196,118 +752,378 @@ void reset_saved_actor(struct actor *actor) {
     }
 }
 
+/* LOADING */
 
 /**
- * @brief Load a previously saved gamestate. The gamestate must have been
- made on the same platform.
+ * @brief Load a previously saved gamestate. The save file is kept, since
+ the journal is replayed on top of it if the game dies before the next save.
  * 
  * @param fname The file to be read.
+ * @return int 0 if the game was loaded, 1 if the file could not be used.
  */
-void load_game(const char *fname) {
-    FILE *fp;
+int load_game(const char *fname) {
+    struct save_buf buf = { 0 };
+    struct stat st;
+    void *map;
+    int fd, ret;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        logm_warning("Load Error: Could not open save file %s.", fname);
+        return 1;
+    }
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        logm_warning("Load Error: Save file %s is empty.", fname);
+        return 1;
+    }
+    /* Map the save rather than reading it in. It is decoded front to back
+       exactly once, so let the kernel read ahead. */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        logm_warning("Load Error: Could not map save file %s.", fname);
+        return 1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    buf.data = map;
+    buf.len = st.st_size;
+    ret = decode_game(&buf);
+    munmap(map, st.st_size);
+    if (ret) {
+        logm_warning("Load Error: %s is not a compatible save file.", fname);
+        return 1;
+    }
+    /* Set up the screen. */
+    setup_gui();
+    return 0;
+}
+
+/**
+ * @brief Restore the gamestate from a buffer written by encode_game().
+ * 
+ * @param buf The buffer to read from.
+ * @return int 1 if the header does not match this version of the game, in
+ which case the gamestate is untouched. 0 otherwise. A save that is
+ corrupted past the header is fatal.
+ */
+int decode_game(struct save_buf *buf) {
     int actor_count;
-    int tile_id;
-    struct actor *cur_actor;
+    unsigned long persistent, seed, draws;
+    uint64_t rng_state[RNG_MAX][4];
+    short heatmap_field;
+    unsigned long counts[POOL_MAX] = { 0 };
+    long prev_action;
     struct actor **addr;
+    struct actor *cur_actor;
 
-    fp = fopen(fname, "r");
-    if (!fp) {
-        logm_warning("Load Error: Could not open save file %d.", fname);
-        return;
+    if (buf->len < SAVE_HEADER_SIZE
+        || memcmp(buf->data, save_magic, sizeof(save_magic))
+        || (buf->data[4] | (buf->data[5] << 8)) != SAVE_VERSION)
+        return 1;
+    /* Size the actor pool. Every record takes at least a byte, so a count
+       larger than the file is garbage. */
+    for (int i = 0; i < POOL_MAX; i++) {
+        for (int j = 0; j < 4; j++)
+            counts[i] |= (unsigned long) buf->data[8 + i * 4 + j] << (j * 8);
+        if (counts[i] > buf->len)
+            return 1;
+    }
+    buf->pos = SAVE_HEADER_SIZE;
+    pool_reserve(counts);
+
+    get_str(buf, g.userbuf, sizeof(g.userbuf));
+    prev_action = get_svar(buf);
+    g.prev_action = (prev_action >= 0 && prev_action < ACTION_COUNT) ? &actions[prev_action] : NULL;
+    g.active_attack_index = get_uvar(buf);
+    g.display_heat = get_uvar(buf);
+    g.turns = get_svar(buf);
+    g.depth = get_svar(buf);
+    g.max_depth = get_svar(buf);
+    g.score = get_svar(buf);
+    g.spawn_countdown = get_svar(buf);
+    g.up_x = get_svar(buf);
+    g.up_y = get_svar(buf);
+    g.down_x = get_svar(buf);
+    g.down_y = get_svar(buf);
+    g.cx = get_svar(buf);
+    g.cy = get_svar(buf);
+    g.cursor_x = get_svar(buf);
+    g.cursor_y = get_svar(buf);
+    g.goal_x = get_svar(buf);
+    g.goal_y = get_svar(buf);
+    persistent = get_uvar(buf);
+    g.debug = persistent & 1;
+    g.practice = (persistent >> 1) & 1;
+    f.mode_explore = (persistent >> 2) & 1;
+    f.mode_run = (persistent >> 3) & 1;
+    set_mapgen((persistent >> 4) & 3);
+    seed = get_uvar(buf);
+    draws = get_uvar(buf);
+    for (int i = 0; i < RNG_MAX; i++) {
+        for (int j = 0; j < 4; j++)
+            rng_state[i][j] = get_uvar(buf);
     }
-    /* Read the global struct */
-    (void) fread(&g, sizeof(struct global), 1, fp);
-    /* Clean up message pointers. We could save the message log fairly easily,
-       but it would take up a lot of space, so we don't. */
+    journal_set_seq(get_uvar(buf));
+    /* We could save the message log fairly easily, but it would take up a lot
+       of space, so we don't. */
     g.msg_list = NULL;
     g.msg_last = NULL;
-    /* Read level map */
-    for (int y = 0; y < MAPH; y++) {
-        for (int x = 0; x < MAPW; x++) {
-            (void) fread(&tile_id, sizeof(int), 1, fp);
-            g.levmap[x][y].pt = &permtiles[tile_id];
-            g.levmap[x][y].actor = NULL;
-            g.levmap[x][y].item_actor = NULL;
-        }
-    }
+
+    decode_levmap(buf);
+
     /* Read the monster dictionary */
+    g.total_monsters = get_uvar(buf);
+    if (g.total_monsters > MAX_ACTORS)
+        panik("Load Error: The save file is corrupted.");
     for (int i = 0; i < g.total_monsters; i++) {
-        g.monsters[i] = load_actor(fp, g.monsters[i]);
+        g.monsters[i] = decode_actor(buf);
     }
+    g.total_items = get_uvar(buf);
+    if (g.total_items > MAX_ACTORS)
+        panik("Load Error: The save file is corrupted.");
     for (int i = 0; i < g.total_items; i++) {
-        g.items[i] = load_actor(fp, g.items[i]);
+        g.items[i] = decode_actor(buf);
     }
     /* Read actors */
-    (void) fread(&actor_count, sizeof(int), 1, fp);
-    cur_actor = g.player;
+    actor_count = get_uvar(buf);
+    if (!actor_count || buf->error)
+        panik("Load Error: The save file is corrupted.");
     addr = &g.player;
     for (int i = 0; i < actor_count; i++) {
-        cur_actor = load_actor(fp, cur_actor);
+        cur_actor = decode_actor(buf);
         *addr = cur_actor;
-        addr = &((*addr)->next);
-        push_actor(cur_actor, cur_actor->x, cur_actor->y);
-        cur_actor->next = NULL;
-        cur_actor = cur_actor->next;
+        addr = &cur_actor->next;
+        if (in_bounds(cur_actor->x, cur_actor->y))
+            push_actor(cur_actor, cur_actor->x, cur_actor->y);
     }
-    fclose(fp);
-    remove(fname);
+    if (buf->error)
+        panik("Load Error: The save file is corrupted.");
+
     /* Post-load pointer cleanup */
     g.target = NULL;
     load_active_attacker();
-    /* Set up the screen. */
-    setup_gui();
+    /* Rebuild the heatmaps the monsters rely on, and the ones that steer
+       the player if they were exploring or traveling. The rest are built
+       when they are needed. */
+    heatmap_field = heatmaps[HM_PLAYER].field | heatmaps[HM_DOWNSTAIR].field;
+    if (f.mode_explore)
+        heatmap_field |= heatmaps[HM_EXPLORE].field;
+    if (f.mode_run)
+        heatmap_field |= heatmaps[HM_GOAL].field;
+    do_heatmaps(heatmap_field, 0);
+    f.update_fov = 1;
+    f.update_map = 1;
+    /* Pick the player's turn back up where the save left it. */
+    f.resume_turn = 1;
+    rnd_set_state(seed, draws, rng_state);
+    return 0;
+}
+
+/**
+ * @brief Read the run-length encoded level map.
+ * 
+ * @param buf The buffer to read from.
+ */
+void decode_levmap(struct save_buf *buf) {
+    unsigned long run = 0;
+    unsigned char byte = 0;
+    int tile_id;
+
+    for (int y = 0; y < MAPH; y++) {
+        for (int x = 0; x < MAPW; x++) {
+            if (!run) {
+                run = get_uvar(buf);
+                byte = get_byte(buf);
+                if (!run || buf->error)
+                    panik("Load Error: The save file is corrupted.");
+            }
+            tile_id = byte >> TB_ID_SHIFT;
+            if (tile_id > T_DOOR_CLOSED)
+                panik("Load Error: Unknown tile %d.", tile_id);
+            init_tile(&g.levmap[x][y], tile_id);
+            g.levmap[x][y].visible = 0;
+            g.levmap[x][y].explored = (byte & TB_EXPLORED) != 0;
+            g.levmap[x][y].lit = (byte & TB_LIT) != 0;
+            run--;
+        }
+    }
 }
 
 /**
- * @brief Load an actor struct from a file.
+ * @brief Work out how large a block the actor pool needs.
  * 
- * @param fp The file to be loaded from.
- * @param actor The location in memory to allocate memory for and
- load the actor. Mutated by this function call.
+ * @param counts How many of each kind of allocation to make room for.
+ * @param offsets Where each kind's run starts in the block. May be NULL.
+ * @return size_t The size of the block.
+ */
+size_t pool_size(const unsigned long *counts, size_t *offsets) {
+    size_t total = 0;
+
+    for (int i = 0; i < POOL_MAX; i++) {
+        if (offsets != NULL)
+            offsets[i] = total;
+        /* Keep each run aligned for any of the component types. */
+        total += (counts[i] * pool_sizes[i] + 15) & ~(size_t) 15;
+    }
+    return total;
+}
+
+/**
+ * @brief Set up the actor pool to hold a given number of actors and
+ components of each kind, replacing any previous pool.
+ * 
+ * @param counts How many of each kind of allocation to make room for.
+ */
+void pool_reserve(const unsigned long *counts) {
+    size_t total = pool_size(counts, NULL);
+    unsigned char *block;
+
+    free_actor_pool();
+    block = calloc(1, max(total, 1));
+    if (block == NULL)
+        panik("Ran out of memory while loading.");
+    pool_place(block, counts);
+    actor_pool.borrowed = 0;
+}
+
+/**
+ * @brief Hand out the actor pool from a zeroed block that the caller owns,
+ replacing any previous pool. The block is left alone when the pool is
+ released.
+ * 
+ * @param block The block, at least pool_size() bytes long.
+ * @param counts How many of each kind of allocation to make room for.
+ */
+void pool_place(void *block, const unsigned long *counts) {
+    size_t offsets[POOL_MAX];
+
+    pool_size(counts, offsets);
+    free_actor_pool();
+    actor_pool.block = block;
+    actor_pool.borrowed = 1;
+    for (int i = 0; i < POOL_MAX; i++) {
+        actor_pool.next[i] = actor_pool.block + offsets[i];
+        actor_pool.left[i] = counts[i];
+    }
+}
+
+/**
+ * @brief Hand out the next free slot of the given kind from the actor pool.
+ * 
+ * @param kind Which kind of allocation to take.
+ * @return void* The slot, which is zeroed.
+ */
+void *pool_take(int kind) {
+    void *ret;
+
+    /* The header promised fewer of these than the file actually holds. */
+    if (!actor_pool.left[kind])
+        panik("Load Error: The save file is corrupted.");
+    ret = actor_pool.next[kind];
+    actor_pool.next[kind] += pool_sizes[kind];
+    actor_pool.left[kind]--;
+    return ret;
+}
+
+/**
+ * @brief Release the actor pool. Every actor loaded from the save must have
+ been freed first.
+ * 
+ */
+void free_actor_pool(void) {
+    if (!actor_pool.borrowed)
+        free(actor_pool.block);
+    memset(&actor_pool, 0, sizeof(actor_pool));
+}
+
+/**
+ * @brief Read an actor record. The actor and its components are taken from
+ the actor pool rather than allocated individually.
+ * 
+ * @param buf The buffer to read from.
  * @return struct actor* The actor that was loaded.
  */
-struct actor *load_actor(FILE *fp, struct actor *actor) {
+struct actor *decode_actor(struct save_buf *buf) {
     int item_count;
+    unsigned long components;
+    struct actor *actor;
     struct actor *cur_item;
     struct actor **addr;
 
-    actor = (struct actor *) malloc(sizeof(struct actor));
-    (void) fread(actor, sizeof(struct actor), 1, fp);
-    if (actor->name) {
-        actor->name = (struct name *) malloc(sizeof(struct name));
-        (void) fread(actor->name, sizeof(struct name), 1, fp);
+    actor = pool_take(POOL_ACTOR);
+    actor->pooled = 1;
+    components = get_uvar(buf);
+    actor->unique = (components & AC_UNIQUE) != 0;
+    actor->can_tech = (components & AC_CAN_TECH) != 0;
+
+    actor->id = get_svar(buf);
+    actor->chr = get_svar(buf);
+    actor->color = get_byte(buf);
+    actor->x = get_byte(buf);
+    actor->y = get_byte(buf);
+    actor->lv = get_byte(buf);
+    actor->energy = get_svar(buf);
+    actor->hp = get_svar(buf);
+    actor->hpmax = get_svar(buf);
+    actor->speed = get_svar(buf);
+    actor->evasion = get_svar(buf);
+    actor->accuracy = get_svar(buf);
+    actor->temp_evasion = get_svar(buf);
+    actor->temp_accuracy = get_svar(buf);
+    actor->combo_counter = get_byte(buf);
+    for (int i = 0; i < MAX_ATTK; i++) {
+        actor->attacks[i].dam = get_byte(buf);
+        actor->attacks[i].kb = get_byte(buf);
+        actor->attacks[i].accuracy = get_byte(buf);
+        actor->attacks[i].stun = get_byte(buf);
+        actor->attacks[i].recovery = get_byte(buf);
+        actor->attacks[i].hitdescs = get_uvar(buf);
     }
-    if (actor->ai) {
-        actor->ai = (struct ai *) malloc(sizeof(struct ai));
-        (void) fread(actor->ai, sizeof(struct ai), 1, fp);
+    actor->stance = get_uvar(buf);
+    actor->old_stance = get_uvar(buf);
+    actor->known = get_uvar(buf);
+
+    if (components & AC_NAME) {
+        actor->name = pool_take(POOL_NAME);
+        get_str(buf, actor->name->real_name, MAXNAMESIZ);
+        get_str(buf, actor->name->appearance, MAXNAMESIZ);
+        get_str(buf, actor->name->given_name, MAXNAMESIZ);
+    }
+    if (components & AC_AI) {
+        actor->ai = pool_take(POOL_AI);
         actor->ai->parent = actor;
+        actor->ai->seekdef = get_svar(buf);
+        actor->ai->seekcur = get_svar(buf);
+        actor->ai->faction = get_uvar(buf);
+        actor->ai->guardian = get_uvar(buf) & 1;
     }
-    if (actor->equip) {
-        actor->equip = (struct equip *) malloc(sizeof(struct equip));
-        (void) fread(actor->equip, sizeof(struct equip), 1, fp);
+    if (components & AC_EQUIP) {
+        actor->equip = pool_take(POOL_EQUIP);
         actor->equip->parent = actor;
     }
-    if (actor->invent) {
-        (void) fread(&item_count, sizeof(int), 1, fp);
-        cur_item = actor->invent;
-        addr = &(actor->invent);
-        for (int i = 0; i < item_count; i++) {
-            cur_item = load_actor(fp, cur_item);
+    if (components & AC_INVENT) {
+        item_count = get_uvar(buf);
+        addr = &actor->invent;
+        for (int i = 0; i < item_count && !buf->error; i++) {
+            cur_item = decode_actor(buf);
             *addr = cur_item;
-            if (cur_item->item->slot >= 0) {
+            addr = &cur_item->next;
+            if (actor->equip && cur_item->item && cur_item->item->slot >= 0
+                && cur_item->item->slot < MAX_SLOTS) {
                 actor->equip->slots[cur_item->item->slot] = cur_item;
             }
-            addr = &((*addr)->next);
-            cur_item->next = NULL;
-            cur_item = cur_item->next;
         }
     }
-    if (actor->item) {
-        actor->item = (struct item *) malloc(sizeof(struct item));
-        (void) fread(actor->item, sizeof(struct item), 1, fp);
+    if (components & AC_ITEM) {
+        actor->item = pool_take(POOL_ITEM);
         actor->item->parent = actor;
+        actor->item->slot = get_svar(buf);
+        actor->item->pref_slot = get_svar(buf);
+        actor->item->poss_slot = get_svar(buf);
+        actor->item->quan = get_svar(buf);
+        actor->item->letter = get_svar(buf);
     }
-    actor->saved = 0;
     return actor;
 }
 
@@ -315,4 +1131,4 @@ void load_active_attacker(void) {
     if (g.active_attack_index < MAX_ATTK) g.active_attacker = g.player;
     else if (g.active_attack_index < MAX_ATTK * 2) g.active_attacker = EWEP(g.player);
     else g.active_attacker = EOFF(g.player);
-}
\ No newline at end of file
+}
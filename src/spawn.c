@@ -198,12 +198,12 @@ int debug_wish(void) {
 void mod_attributes(struct actor *actor) {
     if (!actor)
         return;
-    actor->hpmax += rndmx(1 + g.depth);
+    actor->hpmax += rndmx(RNG_SPAWN, 1 + g.depth);
     actor->hp = actor->hpmax;
     for (int i = 0; i < MAX_ATTK; i++) {
         if (is_noatk(actor->attacks[i])) continue;
-        actor->attacks[i].accuracy += rndrng(-4, 5);
-        actor->attacks[i].dam += rndrng(-1, 2);
+        actor->attacks[i].accuracy += rndrng(RNG_SPAWN, -4, 5);
+        actor->attacks[i].dam += rndrng(RNG_SPAWN, -1, 2);
     }
 }
 
@@ -215,7 +215,7 @@ void mod_attributes(struct actor *actor) {
 void mod_ai(struct ai *ai) {
     if (!ai)
         return;
-    ai->seekdef += rndmx(3);
+    ai->seekdef += rndmx(RNG_SPAWN, 3);
 }
 
 /**
@@ -232,6 +232,7 @@ struct actor *spawn_actor(struct actor **list, int index, int x, int y) {
     struct actor *actor = malloc(sizeof(struct actor));
 
     memcpy(actor, list[index], sizeof(struct actor));
+    actor->pooled = 0;
 
     init_permname(actor, list[index]->name->real_name, list[index]->name->appearance);
 
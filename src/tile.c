@@ -41,7 +41,8 @@ struct tile *init_tile(struct tile *intile, int tindex) {
     intile->pt = &permtiles[tindex];
     intile->actor = NULL;
     intile->item_actor = NULL;
-    intile->refresh = 1;
+    if (intile >= &g.levmap[0][0] && intile < &g.levmap[0][0] + MAPW * MAPH)
+        mark_refresh((intile - &g.levmap[0][0]) / MAPH, (intile - &g.levmap[0][0]) % MAPH);
     return intile;
 }
 
@@ -0,0 +1,33 @@
+/**
+ * @file compile_data.c
+ * @brief The data compiler. Builds the data pack that the game loads its
+ creature, item and wfc definitions from, and optionally the data image that
+ is built from the pack. Run from the directory holding the data directory.
+ * @version 1.0
+ * 
+ */
+
+#include <stdio.h>
+
+#include "datapack.h"
+#include "register.h"
+#include "windows.h"
+
+/**
+ * @brief Main function
+ * 
+ * @param argc Number of arguments
+ * @param argv Argument array
+ * @return int 0 if everything was written, 1 otherwise.
+ */
+int main(int argc, char **argv) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s PACKFILE [IMAGEFILE]\n", argv[0]);
+        return 1;
+    }
+    /* Errors while parsing go through the windowport. */
+    windowprocs = headless_procs;
+    if (compile_data_pack(argv[1]))
+        return 1;
+    return argc == 3 ? compile_data_image(argv[2], argv[1]) : 0;
+}
@@ -0,0 +1,387 @@
+/**
+ * @file mapgen_bench.c
+ * @brief The level generation benchmark. Generates levels without a display
+ from each wfc data file in turn, or as caves, and reports how long they took and what came
+ out, so that regressions in the generator show up. Run from the directory
+ holding the data directory.
+ * @version 1.0
+ * 
+ */
+
+#include <argp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "datapack.h"
+#include "map.h"
+#include "mapgen.h"
+#include "message.h"
+#include "random.h"
+#include "register.h"
+#include "windows.h"
+
+/* The most wfc data files that can be named on the command line. */
+#define MAX_FILES 16
+
+/* What one level came out like. */
+struct level_result {
+    double ms;
+    struct mapgen_stats stats;
+    double open;      /* Open cells, out of every cell inside the border */
+    double reachable; /* Open cells reachable from the up stairs, out of all */
+    int connected;    /* Whether the down stairs can be reached */
+};
+
+struct arguments {
+    const char *files[MAX_FILES];
+    int num_files;
+    int levels;
+    unsigned long long seed;
+    int json;
+    int caves;
+    int width;  /* The size of the sections to generate instead of levels, */
+    int height; /* or 0. */
+};
+
+double now_ms(void);
+void measure_level(struct level_result *);
+void measure_section(const unsigned char *, int, int, struct level_result *);
+int compare_ms(const void *, const void *);
+double percentile(const double *, int, double);
+void print_json_string(const char *);
+void bench_levels(const char *, const struct arguments *);
+error_t parse_args(int, char *, struct argp_state *);
+
+/**
+ * @brief Read the monotonic clock.
+ * 
+ * @return double The time in milliseconds.
+ */
+double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * @brief Measure the level that was just generated: how much of it is open,
+ and how much of that can be walked to from the up stairs. Closed doors count
+ as open, since they can be walked through.
+ * 
+ * @param result Where to put the measurements.
+ */
+void measure_level(struct level_result *result) {
+    static unsigned char seen[MAPW][MAPH];
+    static struct coord queue[MAPW * MAPH];
+    int head = 0;
+    int tail = 0;
+    int open = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (int x = 1; x < MAPW - 1; x++) {
+        for (int y = 1; y < MAPH - 1; y++)
+            open += !is_wall(x, y);
+    }
+    queue[tail++] = (struct coord) { g.up_x, g.up_y };
+    seen[g.up_x][g.up_y] = 1;
+    while (head < tail) {
+        struct coord c = queue[head++];
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                int nx = c.x + dx;
+                int ny = c.y + dy;
+                if (!in_bounds(nx, ny) || seen[nx][ny] || is_wall(nx, ny))
+                    continue;
+                seen[nx][ny] = 1;
+                queue[tail++] = (struct coord) { nx, ny };
+            }
+        }
+    }
+    result->open = (double) open / ((MAPW - 2) * (MAPH - 2));
+    result->reachable = open ? (double) tail / open : 0;
+    result->connected = seen[g.down_x][g.down_y];
+}
+
+/**
+ * @brief Measure a section that was just generated: how much of it is open,
+ and how much of that can be walked to from its first open cell. Connected
+ means all of it can.
+ * 
+ * @param pixels The section.
+ * @param width Its width.
+ * @param height Its height.
+ * @param result Where to put the measurements.
+ */
+void measure_section(const unsigned char *pixels, int width, int height, struct level_result *result) {
+    unsigned char *seen = calloc((size_t) width * height, 1);
+    int *queue = malloc(sizeof(int) * width * height);
+    int head = 0;
+    int tail = 0;
+    int open = 0;
+
+    if (seen == NULL || queue == NULL)
+        panik("Ran out of memory while benchmarking.\n");
+    for (int i = 0; i < width * height; i++) {
+        if (pixels[i] == '#')
+            continue;
+        if (!open++) {
+            queue[tail++] = i;
+            seen[i] = 1;
+        }
+    }
+    while (head < tail) {
+        int x = queue[head] % width;
+        int y = queue[head++] / width;
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                int nx = x + dx;
+                int ny = y + dy;
+                int n = ny * width + nx;
+                if (nx < 0 || nx >= width || ny < 0 || ny >= height || seen[n] || pixels[n] == '#')
+                    continue;
+                seen[n] = 1;
+                queue[tail++] = n;
+            }
+        }
+    }
+    result->open = (double) open / (width * height);
+    result->reachable = open ? (double) tail / open : 0;
+    result->connected = tail == open;
+    free(seen);
+    free(queue);
+}
+
+int compare_ms(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Find a percentile of sorted values, by the nearest rank.
+ * 
+ * @param sorted The values, in ascending order.
+ * @param count How many there are.
+ * @param p The percentile, from 0 to 100.
+ * @return double The value.
+ */
+double percentile(const double *sorted, int count, double p) {
+    int rank = (int) (p / 100.0 * count + 0.999999);
+
+    return sorted[min(max(rank, 1), count) - 1];
+}
+
+/**
+ * @brief Print a string as a JSON string, quoted, with quotes, backslashes and
+ control characters escaped.
+ * 
+ * @param str The string to print.
+ */
+void print_json_string(const char *str) {
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *) str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            printf("\\%c", *c);
+        else if (*c < 0x20 || *c == 0x7f)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+/**
+ * @brief Generate levels the way chosen and report on them. Level i is
+ generated at depth i + 1, so that every level has both stairs, and is the
+ same level every run with the same seed. If a section size was given, wfc
+ sections of that size are generated instead, each seeded as level i would
+ be.
+ * 
+ * @param name What the levels are generated from, for the report.
+ * @param args The options.
+ */
+void bench_levels(const char *name, const struct arguments *args) {
+    struct level_result *results = calloc(args->levels, sizeof(struct level_result));
+    double *sorted = calloc(args->levels, sizeof(double));
+    unsigned char *pixels = NULL;
+    double total = 0, open = 0, min_open = 1, reachable = 0;
+    long attempts = 0, contradictions = 0, backtracks = 0;
+    int retried = 0, fallbacks = 0, chunked = 0, connected = 0;
+
+    if (args->width)
+        pixels = malloc((size_t) args->width * args->height);
+    if (results == NULL || sorted == NULL || (args->width && pixels == NULL))
+        panik("Ran out of memory while benchmarking.\n");
+    for (int i = 0; i < args->levels; i++) {
+        double start;
+
+        if (args->width) {
+            memset(&mapgen_stats, 0, sizeof(mapgen_stats));
+            rnd_stream_seed(RNG_MAPGEN, i + 1);
+            start = now_ms();
+            mapgen_stats.fallback = wfc_generate(0, 0, args->width, args->height, NULL, 0, pixels) != WFC_SUCCESS;
+            results[i].ms = now_ms() - start;
+            results[i].stats = mapgen_stats;
+            if (!mapgen_stats.fallback)
+                measure_section(pixels, args->width, args->height, &results[i]);
+            continue;
+        }
+        g.depth = i + 1;
+        start = now_ms();
+        make_level();
+        results[i].ms = now_ms() - start;
+        results[i].stats = mapgen_stats;
+        measure_level(&results[i]);
+    }
+
+    for (int i = 0; i < args->levels; i++) {
+        struct level_result *r = &results[i];
+        sorted[i] = r->ms;
+        total += r->ms;
+        attempts += r->stats.attempts;
+        contradictions += r->stats.contradictions;
+        backtracks += r->stats.backtracks;
+        retried += r->stats.contradictions > 0;
+        fallbacks += r->stats.fallback;
+        chunked += r->stats.chunked;
+        connected += r->connected;
+        open += r->open;
+        min_open = r->open < min_open ? r->open : min_open;
+        reachable += r->reachable;
+    }
+    qsort(sorted, args->levels, sizeof(double), compare_ms);
+
+    if (args->json) {
+        printf("{\"generator\":");
+        print_json_string(name);
+        printf(",\"levels\":%d,\"width\":%d,\"height\":%d,\"seed\":%llu,"
+               "\"ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+               "\"attempts\":%ld,\"contradictions\":%ld,\"contradiction_rate\":%.4f,"
+               "\"retry_rate\":%.4f,\"backtracks_per_level\":%.2f,"
+               "\"fallback_rate\":%.4f,\"chunked_rate\":%.4f,"
+               "\"connected_rate\":%.4f,\"reachable\":%.4f,\"open\":%.4f,\"min_open\":%.4f}\n",
+               args->levels, args->width ? args->width : MAPW - 2,
+               args->width ? args->height : MAPH - 2, args->seed,
+               total / args->levels, percentile(sorted, args->levels, 50),
+               percentile(sorted, args->levels, 90), percentile(sorted, args->levels, 99),
+               sorted[args->levels - 1],
+               attempts, contradictions, attempts ? (double) contradictions / attempts : 0,
+               (double) retried / args->levels, (double) backtracks / args->levels,
+               (double) fallbacks / args->levels, (double) chunked / args->levels,
+               (double) connected / args->levels, reachable / args->levels,
+               open / args->levels, min_open);
+    } else {
+        if (args->width)
+            printf("%s: %d sections of %dx%d, seed %llu\n", name, args->levels, args->width,
+                   args->height, args->seed);
+        else
+            printf("%s: %d levels, seed %llu\n", name, args->levels, args->seed);
+        printf("  time per level   mean %.3f ms, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+               total / args->levels, percentile(sorted, args->levels, 50),
+               percentile(sorted, args->levels, 90), percentile(sorted, args->levels, 99),
+               sorted[args->levels - 1]);
+        printf("  wfc runs         %ld, %ld contradicted (%.2f%%), %.2f%% of levels retried\n",
+               attempts, contradictions, attempts ? 100.0 * contradictions / attempts : 0,
+               100.0 * retried / args->levels);
+        printf("  backtracks       %.2f per level\n", (double) backtracks / args->levels);
+        printf("  fallbacks        %.2f%% of levels, %.2f%% chunked\n",
+               100.0 * fallbacks / args->levels, 100.0 * chunked / args->levels);
+        printf("  connectivity     %s on %.2f%% of levels, %.2f%% of open cells reachable\n",
+               args->width ? "fully connected" : "stairs connected", 100.0 * connected / args->levels, 100.0 * reachable / args->levels);
+        printf("  open cells       %.2f%% on average, %.2f%% at least\n",
+               100.0 * open / args->levels, 100.0 * min_open);
+    }
+    free(results);
+    free(sorted);
+    free(pixels);
+}
+
+static char doc[] = "Generate levels from each wfc data file (every one the game knows by default), or as caves, and report on them.";
+static char args_doc[] = "[WFCFILE...]";
+static struct argp_option options[] = {
+    { "levels", 'n', "LEVELS", 0, "Generate LEVELS levels from each file. Defaults to 100.", 0},
+    { "seed",   's', "SEED", 0, "Seed the random number generator with SEED. Defaults to 1.", 0},
+    { "json",   'j', 0, 0, "Print one JSON object per file instead of a report.", 0},
+    { "caves",  'c', 0, 0, "Also generate levels as caves with the cellular automaton.", 0},
+    { "section", 'S', "WxH", 0, "Generate bare wfc sections of W by H cells instead of levels, without stairs or set pieces. Sections wider or taller than 96 are solved a chunk at a time. Cannot be combined with --caves.", 0},
+    {0}
+};
+static struct argp argp = { options, parse_args, args_doc, doc, 0, 0, 0 };
+
+error_t parse_args(int key, char *arg, struct argp_state *state) {
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'n':
+            args->levels = atoi(arg);
+            if (args->levels < 1)
+                argp_error(state, "LEVELS must be at least 1.");
+            break;
+        case 's':
+            args->seed = strtoull(arg, NULL, 0);
+            break;
+        case 'j':
+            args->json = 1;
+            break;
+        case 'c':
+            args->caves = 1;
+            break;
+        case 'S':
+            if (sscanf(arg, "%dx%d", &args->width, &args->height) != 2
+                || args->width < 2 || args->height < 2 || args->width > 4096 || args->height > 4096)
+                argp_error(state, "WxH must be two sizes from 2 to 4096, such as 300x200.");
+            break;
+        case ARGP_KEY_END:
+            if (args->caves && args->width)
+                argp_error(state, "Caves are always whole levels, so --caves cannot be combined with --section.");
+            break;
+        case ARGP_KEY_ARG:
+            if (args->num_files >= MAX_FILES)
+                argp_usage(state);
+            args->files[args->num_files++] = arg;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+/**
+ * @brief Main function
+ * 
+ * @param argc Number of arguments
+ * @param argv Argument array
+ * @return int 0 if every file could be benchmarked, 1 otherwise.
+ */
+int main(int argc, char **argv) {
+    struct arguments args = { .levels = 100, .seed = 1 };
+
+    argp_parse(&argp, argc, argv, 0, 0, &args);
+    /* Errors while generating go through the windowport. */
+    windowprocs = headless_procs;
+    /* Shuffling the data draws random numbers, so seed first. */
+    rndseed(args.seed);
+    load_game_data();
+    if (!args.num_files) {
+        for (int i = 0; i < num_data_files; i++) {
+            if (data_files[i].kind == DATA_WFC && args.num_files < MAX_FILES)
+                args.files[args.num_files++] = data_files[i].fname;
+        }
+    }
+    for (int i = 0; i < args.num_files; i++) {
+        if (load_wfc_rules(args.files[i]) == NULL) {
+            fprintf(stderr, "Could not load wfc rules from %s.\n", args.files[i]);
+            return 1;
+        }
+        set_wfc_rules(args.files[i]);
+        bench_levels(args.files[i], &args);
+    }
+    if (args.caves) {
+        set_mapgen(MAPGEN_CAVES);
+        bench_levels("caves", &args);
+    }
+    return 0;
+}
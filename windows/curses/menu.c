@@ -17,13 +17,15 @@
 #include "windows.h"
 #include "menu.h"
 
+void display_menu(struct menu *);
+
 /**
  * @brief Initialize a new menu and give it focus.
  * 
  * @param title The title of the new menu.
  * @return struct menu* The menu that has been created.
  */
-struct menu *menu_new(const char *title, int x, int y, int w, int h) {
+struct menu *curses_menu_new(const char *title, int x, int y, int w, int h) {
     struct menu *new_menu = malloc(sizeof(struct menu));
     new_menu->title = title;
     new_menu->max = 0;
@@ -43,7 +45,7 @@ struct menu *menu_new(const char *title, int x, int y, int w, int h) {
  * @param index The letter associated with the item.
  * @param text The text associated with the menu item. 
  */
-void menu_add_item(struct menu *menu, unsigned char index, const char *text) {
+void curses_menu_add_item(struct menu *menu, unsigned char index, const char *text) {
     struct menu_item *cur = menu->items;
     struct menu_item *prev = menu->items;
 
@@ -109,7 +111,7 @@ them to navigate the menu and select different options.
  * @return signed char The index that was selected. Returns -1 if the menu is
 exited from and nothing is chosen. The caller must handle a response of -1.
  */
-signed char menu_do_choice(struct menu *menu, int can_quit) {
+signed char curses_menu_do_choice(struct menu *menu, int can_quit) {
     struct menu_item *cur_item = menu->items;
     int x, y;
     MEVENT event;
@@ -158,7 +160,7 @@ signed char menu_do_choice(struct menu *menu, int can_quit) {
  * 
  * @param menu The menu to be destroyed.
  */
-void menu_destroy(struct menu *menu) {
+void curses_menu_destroy(struct menu *menu) {
     struct menu_item *cur = menu->items;
     struct menu_item *prev = menu->items;
 
@@ -29,6 +29,26 @@
 #include "save.h"
 #include "combat.h"
 
+void curses_setup_screen(void);
+void curses_cleanup_screen(void);
+void curses_title_screen(void);
+void curses_setup_gui(void);
+void curses_flush_screen(void);
+void curses_text_entry(const char *, char *, int);
+void curses_display_file_text(const char *);
+void curses_display_sb(void);
+void curses_draw_msg_window(int);
+void curses_draw_lifebars(void);
+int curses_map_put_tile(int, int, int, int, int);
+int curses_map_put_actor(int, int, struct actor *, int);
+int curses_map_putch(int, int, int, int);
+int curses_map_putch_truecolor(int, int, int, unsigned);
+int curses_map_put_row(int, int, const struct glyph *, int);
+void curses_clear_map(void);
+void curses_refresh_map(void);
+void curses_scroll_map(int, int);
+int curses_handle_keys(void);
+chtype color_attr(unsigned char);
 void setup_locale(void);
 void setup_colors(void);
 void popup_warning(const char *);
@@ -36,10 +56,12 @@ void print_hitdescs(WINDOW *, int, int, short, unsigned char);
 void print_stance(struct actor *, WINDOW *, int, int);
 void render_bar(WINDOW*, int, int, int, int, int, int);
 int handle_mouse(void);
-void curses_display_sb(WINDOW *);
+void display_sb_window(WINDOW *);
 void display_sb_nearby(WINDOW *, int *);
 void display_sb_controls(WINDOW *, int *j);
 void display_sb_stats(WINDOW *, int *, struct actor *);
+int msg_lines(struct msg *);
+void update_msg_pad(void);
 
 #define MAX_FILE_LEN 200
 
@@ -56,8 +78,51 @@ struct zz_win msgbox_win;
 struct zz_win sb_win_left;
 struct zz_win sb_win_right;
 
+struct window_procs curses_procs = {
+    "curses",
+    1,
+    curses_setup_screen,
+    curses_cleanup_screen,
+    curses_title_screen,
+    curses_setup_gui,
+    curses_flush_screen,
+    curses_text_entry,
+    curses_display_file_text,
+    curses_display_sb,
+    curses_draw_msg_window,
+    curses_draw_lifebars,
+    curses_map_put_tile,
+    curses_map_put_actor,
+    curses_map_putch,
+    curses_map_putch_truecolor,
+    curses_map_put_row,
+    curses_clear_map,
+    curses_refresh_map,
+    curses_scroll_map,
+    curses_handle_keys,
+    curses_menu_new,
+    curses_menu_add_item,
+    curses_menu_do_choice,
+    curses_menu_destroy
+};
+
+/* Id of the newest message already drawn to msg_win. */
+static unsigned long msg_drawn_id = 0;
+
 /* SCREEN FUNCTIONS */
 
+/**
+ * @brief Get the curses attributes used to draw a color.
+ * 
+ * @param color The color.
+ * @return chtype The color pair, and A_BOLD if the color is bright.
+ */
+chtype color_attr(unsigned char color) {
+    if (color >= BRIGHT_COLOR)
+        return COLOR_PAIR(color) | A_BOLD;
+    return COLOR_PAIR(color);
+}
+
 void wcolor_on(WINDOW *win, unsigned char color) {
     wattron(win, COLOR_PAIR(color));
     if (color >= BRIGHT_COLOR)
@@ -70,7 +135,7 @@ void wcolor_off(WINDOW *win, unsigned char color) {
         wattroff(win, A_BOLD);
 }
 
-void title_screen(void) {
+void curses_title_screen(void) {
     WINDOW *background;
     struct zz_win background_container;
     struct menu *selector;
@@ -88,32 +153,32 @@ void title_screen(void) {
 
     snprintf(buf, sizeof(buf), "Zenzizenzizenzic v%d.%d.%d-%s", 
              VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, RELEASE_STATE);
-    selector = menu_new(buf, 1, 1, 35, 8);
+    selector = curses_menu_new(buf, 1, 1, 35, 8);
 
-    menu_add_item(selector, 'p', "Play");
-    menu_add_item(selector, 'd', "View Last Character");
-    menu_add_item(selector, 'r', "Records");
-    menu_add_item(selector, 'h', "Help");
-    menu_add_item(selector, 'q', "Quit");
+    curses_menu_add_item(selector, 'p', "Play");
+    curses_menu_add_item(selector, 'd', "View Last Character");
+    curses_menu_add_item(selector, 'r', "Records");
+    curses_menu_add_item(selector, 'h', "Help");
+    curses_menu_add_item(selector, 'q', "Quit");
 
     while (1) {
-        selected = menu_do_choice(selector, 0);
+        selected = curses_menu_do_choice(selector, 0);
         switch (selected) {
             case 'p':
-                menu_destroy(selector);
+                curses_menu_destroy(selector);
                 cleanup_win(background_container);
                 return;
             case 'd':
-                display_file_text("dumplog.txt");
+                curses_display_file_text("dumplog.txt");
                 break;
             case 'r':
                 popup_warning("The high score list has not yet been implemented.");
                 break;
             case 'h':
-                display_file_text("data/text/help.txt");
+                curses_display_file_text("data/text/help.txt");
                 break;
             case 'q':
-                menu_destroy(selector);
+                curses_menu_destroy(selector);
                 cleanup_win(background_container);
                 exit(0);
         }
@@ -124,17 +189,18 @@ void title_screen(void) {
  * @brief Perform the first-time setup for the game's GUI.
  * 
  */
-void setup_gui(void) {
+void curses_setup_gui(void) {
     map_win = create_win(term.mapwin_h, term.mapwin_w, term.mapwin_y, term.mapwin_x);
     bars_win = create_win(4, term.msg_w, 0, 0);
     msgbox_win = create_win(term.msg_h, term.msg_w, term.msg_y, 0);
     msg_win = newpad(term.h, term.msg_w);
     new_panel(msg_win);
+    msg_drawn_id = 0;
     sb_win_left = create_win(term.sb_h, term.mapwin_x, term.mapwin_y, 0);
     sb_win_right = create_win(term.sb_h, term.sb_w, term.mapwin_y, term.sb_x);
     f.update_map = 1;
-    draw_msg_window(0);
-    draw_lifebars();
+    curses_draw_msg_window(0);
+    curses_draw_lifebars();
     wrefresh(map_win.win);
     update_panels();
     doupdate();
@@ -162,7 +228,7 @@ this initializes the screen, turns off echoing, and does the basic setup
 needed for curses to do its job.
  * 
  */
-void setup_screen(void) {
+void curses_setup_screen(void) {
     int h, w;
     putenv("ESCDELAY=25");
     initscr();
@@ -220,13 +286,22 @@ void setup_colors(void) {
 used to clean up curses artifacts.
  * 
  */
-void cleanup_screen(void) {
+void curses_cleanup_screen(void) {
     endwin();
     return;
 }
 
 /* WINDOW MANAGEMENT FUNCTIONS */
 
+/**
+ * @brief Push all pending changes to the terminal.
+ * 
+ */
+void curses_flush_screen(void) {
+    update_panels();
+    doupdate();
+}
+
 /**
  * @brief Create a new window. Wrapper for curses function newwin.
  * 
@@ -281,7 +356,7 @@ void popup_warning(const char *text) {
     update_panels();
     doupdate();
 
-    while ((keycode = handle_keys())) {
+    while ((keycode = curses_handle_keys())) {
         if (keycode == 27)
             break;
     }
@@ -298,7 +373,7 @@ void popup_warning(const char *text) {
  * @param buf The buffer to write to.
  * @param bufsiz The size of the buffer to write to.
  */
-void text_entry(const char *prompt, char *buf, int bufsiz) {
+void curses_text_entry(const char *prompt, char *buf, int bufsiz) {
     WINDOW *new_win;
     struct zz_win new_win_container;
     int keycode;
@@ -319,7 +394,7 @@ void text_entry(const char *prompt, char *buf, int bufsiz) {
     update_panels();
     doupdate();
 
-    while ((keycode = handle_keys())) {
+    while ((keycode = curses_handle_keys())) {
         if (keycode >= 32 && keycode <= 'z' && index < bufsiz) {
             buf[index++] = keycode;
         } else if (keycode == '\b') {
@@ -349,7 +424,7 @@ void text_entry(const char *prompt, char *buf, int bufsiz) {
  * 
  * @param fname Filename to be displayed.
  */
-void display_file_text(const char *fname) {
+void curses_display_file_text(const char *fname) {
     FILE *fp;
     WINDOW *new_win;
     PANEL *newpanel;
@@ -375,7 +450,7 @@ void display_file_text(const char *fname) {
     while (1) {
         prefresh(new_win, j, 0, 0, 0, term.h - 1, term.w - 1);
 
-        key = handle_keys();
+        key = curses_handle_keys();
         switch (key) {
             case 27:
                 werase(new_win);
@@ -402,9 +477,9 @@ void display_file_text(const char *fname) {
 }
 
 /* Windowport code. Displays both sidebars. */
-void display_sb(void) {
-    curses_display_sb(sb_win_left.win);
-    curses_display_sb(sb_win_right.win);
+void curses_display_sb(void) {
+    display_sb_window(sb_win_left.win);
+    display_sb_window(sb_win_right.win);
 }
 
 /**
@@ -412,7 +487,7 @@ void display_sb(void) {
  * 
  * @param sb_win The window in question.
  */
-void curses_display_sb(WINDOW *sb_win) {
+void display_sb_window(WINDOW *sb_win) {
     int j = 1;
 
     werase(sb_win);
@@ -608,16 +683,6 @@ void render_bar(WINDOW *win, int cur, int max, int x, int y,
     wattroff(win, A_REVERSE);
 }
 
-/**
- * @brief Action that fullscrens the message window.
- * 
- * @return int Cost of fullscreening.
- */
-int fullscreen_action(void) {
-    draw_msg_window(1);
-    return 0;
-}
-
 /**
  * @brief Print the current stance of an actor to the window.
  * 
@@ -648,7 +713,7 @@ void print_stance(struct actor *actor, WINDOW *win, int y, int x) {
     }
 }
 
-void draw_lifebars(void) {
+void curses_draw_lifebars(void) {
     char buf[4] = {'\0'};
     WINDOW *bars_win_p = bars_win.win;
 
@@ -679,24 +744,80 @@ void draw_lifebars(void) {
 }
 
 /**
- * @brief Draw the message window.
+ * @brief Count the number of lines a message occupies once wrapped.
  * 
- * @param full wehther it is being drawn fullscreen.
+ * @param message The message to measure.
+ * @return int The number of lines.
  */
-void draw_msg_window(int full) {
-    int i = 0;
+int msg_lines(struct msg *message) {
+    int lines = 1;
+    for (char *c = message->msg; *c != '\0'; c++) {
+        if (*c == '\n') lines++;
+    }
+    return lines;
+}
+
+/**
+ * @brief Bring the message pad up to date with the message list. Messages
+ are drawn newest-first, so any message logged since the last call is
+ inserted at the top of the pad, pushing the older lines down, and lines
+ belonging to messages that fell out of the backscroll are trimmed from the
+ bottom. The pad is only rewritten in full on the first draw, or if curses
+ wrapped a line that we did not.
+ * 
+ */
+void update_msg_pad(void) {
+    int new_lines = 0;
+    int lines = 0;
     struct msg *cur_msg;
 
-    werase(msg_win);
-    cur_msg = g.msg_list;
-    while (cur_msg != NULL) {
+    if (g.msg_list == NULL || g.msg_list->id == msg_drawn_id)
+        return;
+
+    if (msg_drawn_id) {
+        for (cur_msg = g.msg_list; cur_msg != NULL && cur_msg->id > msg_drawn_id; cur_msg = cur_msg->next) {
+            new_lines += msg_lines(cur_msg);
+        }
+        wmove(msg_win, 0, 0);
+        winsdelln(msg_win, new_lines);
+    } else {
+        werase(msg_win);
+    }
+    for (cur_msg = g.msg_list; cur_msg != NULL && cur_msg->id > msg_drawn_id; cur_msg = cur_msg->next) {
         wcolor_on(msg_win, cur_msg->attr);
         waddstr(msg_win, cur_msg->msg);
         wcolor_off(msg_win, cur_msg->attr);
         waddch(msg_win, '\n');
-        cur_msg = cur_msg->next;
-        i++;
+        lines += msg_lines(cur_msg);
     }
+    if (msg_drawn_id && getcury(msg_win) != new_lines) {
+        msg_drawn_id = 0;
+        update_msg_pad();
+        return;
+    }
+    /* A message too long for the pad wrapped on its own. Leave msg_drawn_id
+       unset so that the next update is another full rewrite. */
+    if (!msg_drawn_id && getcury(msg_win) != lines && getcury(msg_win) < getmaxy(msg_win) - 1)
+        return;
+    msg_drawn_id = g.msg_list->id;
+
+    lines = 0;
+    for (cur_msg = g.msg_list; cur_msg != NULL; cur_msg = cur_msg->next) {
+        lines += msg_lines(cur_msg);
+    }
+    if (lines < getmaxy(msg_win)) {
+        wmove(msg_win, lines, 0);
+        wclrtobot(msg_win);
+    }
+}
+
+/**
+ * @brief Draw the message window.
+ * 
+ * @param full wehther it is being drawn fullscreen.
+ */
+void curses_draw_msg_window(int full) {
+    update_msg_pad();
     box(msgbox_win.win, 0, 0);
     if (full) {
         prefresh(msg_win, 0, 0, 0, 0, term.h, term.w);
@@ -723,8 +844,8 @@ void draw_msg_window(int full) {
  * @param attr attributes to render with.
  * @return int result of map_putch.
  */
-int map_put_tile(int x, int y, int mx, int my, int attr) {
-    return map_putch(x, y, g.levmap[mx][my].pt->chr, attr);
+int curses_map_put_tile(int x, int y, int mx, int my, int attr) {
+    return curses_map_putch(x, y, g.levmap[mx][my].pt->chr, attr);
 }
 
 /**
@@ -734,20 +855,15 @@ int map_put_tile(int x, int y, int mx, int my, int attr) {
  * @param y y coordinate to render at.
  * @param actor actor to be rendered.
  * @param attr attributes to render with.
- * @return int result of map_putch.
+ * @return int Result of mvwaddch().
  */
-int map_put_actor(int x, int y, struct actor *actor, int attr) {
-    int ret;
-    if (actor == g.target)
-        wattron(map_win.win, A_UNDERLINE);
-    if (actor == g.player)
-        wattron(map_win.win, A_REVERSE);
-    ret = map_putch(x, y, actor->chr, attr);
+int curses_map_put_actor(int x, int y, struct actor *actor, int attr) {
+    chtype ch = actor->chr | color_attr(attr);
     if (actor == g.target)
-        wattroff(map_win.win, A_UNDERLINE);
+        ch |= A_UNDERLINE;
     if (actor == g.player)
-        wattroff(map_win.win, A_REVERSE);
-    return ret;
+        ch |= A_REVERSE;
+    return mvwaddch(map_win.win, y, x, ch);
 }
 
 /**
@@ -759,12 +875,31 @@ int map_put_actor(int x, int y, struct actor *actor, int attr) {
  * @param attr attributes to render with.
  * @return int Result of mvwaddch().
  */
-int map_putch(int x, int y, int chr, int attr) {
-    int ret;
-    wcolor_on(map_win.win, attr);
-    ret = mvwaddch(map_win.win, y, x, chr); 
-    wcolor_off(map_win.win, attr);
-    return ret;
+int curses_map_putch(int x, int y, int chr, int attr) {
+    return mvwaddch(map_win.win, y, x, chr | color_attr(attr));
+}
+
+/**
+ * @brief Output a run of cells to a single row of the map window. The
+ glyphs are converted to a chtype array that carries the attributes of each
+ cell, so the whole run goes out with one call to mvwaddchnstr().
+ * 
+ * @param x x coordinate of the first cell.
+ * @param y y coordinate of the row.
+ * @param row glyphs to render.
+ * @param n number of glyphs in row.
+ * @return int Result of mvwaddchnstr().
+ */
+int curses_map_put_row(int x, int y, const struct glyph *row, int n) {
+    chtype buf[n + 1];
+
+    if (n <= 0)
+        return ERR;
+    for (int i = 0; i < n; i++) {
+        buf[i] = row[i].chr | color_attr(row[i].color);
+    }
+    buf[n] = 0;
+    return mvwaddchnstr(map_win.win, y, x, buf, n);
 }
 
 /**
@@ -777,16 +912,16 @@ int map_putch(int x, int y, int chr, int attr) {
  * @param attr attributes to render with.
  * @return int Result of map_putch().
  */
-int map_putch_truecolor(int x, int y, int chr, unsigned color) {
+int curses_map_putch_truecolor(int x, int y, int chr, unsigned color) {
     int final_color = color % MAX_COLOR;
-    return map_putch(x, y, chr, final_color);
+    return curses_map_putch(x, y, chr, final_color);
 }
 
 /**
  * @brief Erase the map window.
  * 
  */
-void clear_map(void) {
+void curses_clear_map(void) {
     werase(map_win.win);
 }
 
@@ -795,11 +930,42 @@ void clear_map(void) {
  to the player's location.
  * 
  */
-void refresh_map(void) {
+void curses_refresh_map(void) {
     wmove(map_win.win, g.player->y - g.cy, g.player->x - g.cx);
     wrefresh(map_win.win);
 }
 
+/**
+ * @brief Shift the contents of the map window to follow the camera. The
+ strips of the window left behind keep their old contents, and must be
+ redrawn by the caller.
+ * 
+ * @param dx Number of columns the camera moved to the right.
+ * @param dy Number of rows the camera moved down.
+ */
+void curses_scroll_map(int dx, int dy) {
+    int h = getmaxy(map_win.win);
+    int w = getmaxx(map_win.win);
+    chtype row[w + 1];
+
+    if (dy) {
+        scrollok(map_win.win, TRUE);
+        wscrl(map_win.win, dy);
+        scrollok(map_win.win, FALSE);
+    }
+    if (dx) {
+        for (int y = 0; y < h; y++) {
+            if (dx > 0) {
+                mvwinchnstr(map_win.win, y, dx, row, w - dx);
+                mvwaddchnstr(map_win.win, y, 0, row, w - dx);
+            } else {
+                mvwinchnstr(map_win.win, y, 0, row, w + dx);
+                mvwaddchnstr(map_win.win, y, -dx, row, w + dx);
+            }
+        }
+    }
+}
+
 /**
  * @brief Handle mouse inputs.
  * 
@@ -856,7 +1022,7 @@ int handle_mouse(void) {
  * 
  * @return int Return the action taken.
  */
-int handle_keys(void) {
+int curses_handle_keys(void) {
     int keycode = getch();
     /* This is a bit more complicated than other input systems,
        since curses picks up character codes, rather than
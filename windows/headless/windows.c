@@ -0,0 +1,288 @@
+/**
+ * @file windows.c
+ * @brief The headless windowport. Draws nothing, and reads its input from
+ a script instead of a terminal. Used for running bots, soak tests and
+ benchmarks without a TTY.
+ * @version 1.0
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "register.h"
+#include "windows.h"
+#include "menu.h"
+#include "message.h"
+
+void headless_setup_screen(void);
+void headless_cleanup_screen(void);
+void headless_nothing(void);
+void headless_text_entry(const char *, char *, int);
+void headless_display_file_text(const char *);
+void headless_draw_msg_window(int);
+int headless_map_put_tile(int, int, int, int, int);
+int headless_map_put_actor(int, int, struct actor *, int);
+int headless_map_putch(int, int, int, int);
+int headless_map_putch_truecolor(int, int, int, unsigned);
+int headless_map_put_row(int, int, const struct glyph *, int);
+void headless_scroll_map(int, int);
+int headless_handle_keys(void);
+struct menu *headless_menu_new(const char *, int, int, int, int);
+void headless_menu_add_item(struct menu *, unsigned char, const char *);
+signed char headless_menu_do_choice(struct menu *, int);
+void headless_menu_destroy(struct menu *);
+
+/* The dimensions the game lays itself out for when there is no terminal. */
+#define HEADLESS_TERM_H 40
+#define HEADLESS_TERM_W 120
+
+/* Where scripted input is read from. Defaults to standard input. */
+static FILE *script = NULL;
+
+struct window_procs headless_procs = {
+    "headless",
+    0,
+    headless_setup_screen,
+    headless_cleanup_screen,
+    headless_nothing,
+    headless_nothing,
+    headless_nothing,
+    headless_text_entry,
+    headless_display_file_text,
+    headless_nothing,
+    headless_draw_msg_window,
+    headless_nothing,
+    headless_map_put_tile,
+    headless_map_put_actor,
+    headless_map_putch,
+    headless_map_putch_truecolor,
+    headless_map_put_row,
+    headless_nothing,
+    headless_nothing,
+    headless_scroll_map,
+    headless_handle_keys,
+    headless_menu_new,
+    headless_menu_add_item,
+    headless_menu_do_choice,
+    headless_menu_destroy
+};
+
+/**
+ * @brief Set the file that scripted input is read from.
+ * 
+ * @param fname Name of the file. If NULL or "-", standard input is used.
+ */
+void headless_set_input(const char *fname) {
+    if (fname == NULL || !strcmp(fname, "-")) {
+        script = stdin;
+        return;
+    }
+    script = fopen(fname, "r");
+    if (script == NULL) {
+        fprintf(stderr, "Could not open input script %s.\n", fname);
+        exit(1);
+    }
+}
+
+/**
+ * @brief Set up the headless "screen". Lays the game out as though it were
+ running in a terminal of a fixed size, since message wrapping and the camera
+ depend on the terminal dimensions.
+ * 
+ */
+void headless_setup_screen(void) {
+    if (script == NULL)
+        script = stdin;
+    setup_term_dimensions(HEADLESS_TERM_H, HEADLESS_TERM_W, 1, 1);
+}
+
+/**
+ * @brief Close the input script.
+ * 
+ */
+void headless_cleanup_screen(void) {
+    if (script != NULL && script != stdin)
+        fclose(script);
+    script = NULL;
+}
+
+/**
+ * @brief Do nothing. Stands in for every function that only draws.
+ * 
+ */
+void headless_nothing(void) {
+    return;
+}
+
+/**
+ * @brief Read a line of scripted input into a buffer.
+ * 
+ * @param prompt Unused.
+ * @param buf The buffer to write to.
+ * @param bufsiz The size of the buffer to write to.
+ */
+void headless_text_entry(const char *prompt, char *buf, int bufsiz) {
+    int keycode;
+    int index = 0;
+    (void) prompt;
+
+    while ((keycode = headless_handle_keys()) != '\n') {
+        if (keycode == 27) {
+            index = 0;
+            break;
+        }
+        if (index < bufsiz - 1)
+            buf[index++] = keycode;
+    }
+    buf[index] = '\0';
+}
+
+/**
+ * @brief Files are never displayed.
+ * 
+ * @param fname Unused.
+ */
+void headless_display_file_text(const char *fname) {
+    (void) fname;
+}
+
+/**
+ * @brief The message window is never displayed.
+ * 
+ * @param full Unused.
+ */
+void headless_draw_msg_window(int full) {
+    (void) full;
+    f.update_msg = 0;
+}
+
+/* Map drawing functions. These all do nothing. */
+
+int headless_map_put_tile(int x, int y, int mx, int my, int attr) {
+    (void) x; (void) y; (void) mx; (void) my; (void) attr;
+    return 0;
+}
+
+int headless_map_put_actor(int x, int y, struct actor *actor, int attr) {
+    (void) x; (void) y; (void) actor; (void) attr;
+    return 0;
+}
+
+int headless_map_putch(int x, int y, int chr, int attr) {
+    (void) x; (void) y; (void) chr; (void) attr;
+    return 0;
+}
+
+int headless_map_putch_truecolor(int x, int y, int chr, unsigned color) {
+    (void) x; (void) y; (void) chr; (void) color;
+    return 0;
+}
+
+int headless_map_put_row(int x, int y, const struct glyph *row, int n) {
+    (void) x; (void) y; (void) row; (void) n;
+    return 0;
+}
+
+void headless_scroll_map(int dx, int dy) {
+    (void) dx; (void) dy;
+}
+
+/**
+ * @brief Read the next key from the input script. The game ends once the
+ script runs out.
+ * 
+ * @return int The key read.
+ */
+int headless_handle_keys(void) {
+    int keycode = fgetc(script);
+    if (keycode == EOF) {
+        if (g.debug)
+            printf("Input script exhausted.\n");
+        exit(0);
+    }
+    return keycode;
+}
+
+/**
+ * @brief Create a new menu. No window is created.
+ * 
+ * @param title The title of the new menu.
+ * @return struct menu* The menu that has been created.
+ */
+struct menu *headless_menu_new(const char *title, int x, int y, int w, int h) {
+    struct menu *new_menu = malloc(sizeof(struct menu));
+    (void) x; (void) y; (void) w; (void) h;
+    memset(new_menu, 0, sizeof(struct menu));
+    new_menu->title = title;
+    return new_menu;
+}
+
+/**
+ * @brief Add an item to an existing menu.
+ * 
+ * @param menu The menu the item is to be added to.
+ * @param index The letter associated with the item.
+ * @param text The text associated with the menu item.
+ */
+void headless_menu_add_item(struct menu *menu, unsigned char index, const char *text) {
+    struct menu_item **cur = &menu->items;
+    struct menu_item *new_item = malloc(sizeof(struct menu_item));
+
+    new_item->index = index;
+    new_item->next = NULL;
+    snprintf(new_item->text, sizeof(new_item->text), "%s", text);
+    while (*cur != NULL)
+        cur = &(*cur)->next;
+    *cur = new_item;
+    menu->max += 1;
+}
+
+/**
+ * @brief Pick a menu item using the input script. Accepts the same keys as
+ the curses menus, minus the arrow keys and mouse.
+ * 
+ * @param menu The menu that is taking input.
+ * @param can_quit Defines whether the menu can be exited manually.
+ * @return signed char The index that was selected, or -1 if the menu was
+ exited.
+ */
+signed char headless_menu_do_choice(struct menu *menu, int can_quit) {
+    struct menu_item *cur_item;
+    int input;
+
+    while (1) {
+        input = headless_handle_keys();
+        if (input == 27 && can_quit) {
+            return -1;
+        } else if (input == '\n' || input == '\r') {
+            cur_item = menu->items;
+            for (int i = 0; i < menu->selected && cur_item != NULL; i++) {
+                cur_item = cur_item->next;
+            }
+            if (cur_item != NULL)
+                return cur_item->index;
+        } else if (input >= 'a' && input <= 'z') {
+            return input;
+        }
+    }
+}
+
+/**
+ * @brief Destroy a menu and free all memory associated with it.
+ * 
+ * @param menu The menu to be destroyed.
+ */
+void headless_menu_destroy(struct menu *menu) {
+    struct menu_item *cur = menu->items;
+    struct menu_item *next;
+
+    while (cur != NULL) {
+        next = cur->next;
+        free(cur);
+        cur = next;
+    }
+    free(menu);
+    f.update_msg = 1;
+}